@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/mccomp.dir/src/mccomp.cpp.o"
+  "CMakeFiles/mccomp.dir/src/mccomp.cpp.o.d"
+  "libmccomp.a"
+  "libmccomp.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/mccomp.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
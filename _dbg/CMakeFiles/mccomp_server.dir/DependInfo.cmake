@@ -0,0 +1,24 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/src/mccomp_archive.cpp" "CMakeFiles/mccomp_server.dir/src/mccomp_archive.cpp.o" "gcc" "CMakeFiles/mccomp_server.dir/src/mccomp_archive.cpp.o.d"
+  "/root/repo/src/mccomp_columnar.cpp" "CMakeFiles/mccomp_server.dir/src/mccomp_columnar.cpp.o" "gcc" "CMakeFiles/mccomp_server.dir/src/mccomp_columnar.cpp.o.d"
+  "/root/repo/src/mccomp_delta.cpp" "CMakeFiles/mccomp_server.dir/src/mccomp_delta.cpp.o" "gcc" "CMakeFiles/mccomp_server.dir/src/mccomp_delta.cpp.o.d"
+  "/root/repo/src/mccomp_entropy.cpp" "CMakeFiles/mccomp_server.dir/src/mccomp_entropy.cpp.o" "gcc" "CMakeFiles/mccomp_server.dir/src/mccomp_entropy.cpp.o.d"
+  "/root/repo/src/mccomp_follow.cpp" "CMakeFiles/mccomp_server.dir/src/mccomp_follow.cpp.o" "gcc" "CMakeFiles/mccomp_server.dir/src/mccomp_follow.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  "/root/repo/_dbg/CMakeFiles/mccomp.dir/DependInfo.cmake"
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
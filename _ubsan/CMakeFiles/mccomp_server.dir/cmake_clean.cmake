@@ -0,0 +1,19 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/mccomp_server.dir/src/mccomp_archive.cpp.o"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_archive.cpp.o.d"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_columnar.cpp.o"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_columnar.cpp.o.d"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_delta.cpp.o"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_delta.cpp.o.d"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_entropy.cpp.o"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_entropy.cpp.o.d"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_follow.cpp.o"
+  "CMakeFiles/mccomp_server.dir/src/mccomp_follow.cpp.o.d"
+  "libmccomp_server.a"
+  "libmccomp_server.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/mccomp_server.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/mccomp_test.dir/main.cpp.o"
+  "CMakeFiles/mccomp_test.dir/main.cpp.o.d"
+  "mccomp_test"
+  "mccomp_test.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/mccomp_test.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -1,4 +1,9 @@
 #include "src/mccomp.h"
+#include "src/mccomp_archive.h"
+#include "src/mccomp_columnar.h"
+#include "src/mccomp_delta.h"
+#include "src/mccomp_entropy.h"
+#include "src/mccomp_follow.h"
 
 #include <cstdio>
 #include <iostream>
@@ -9,8 +14,24 @@
 #include <assert.h>
 #include <stdio.h>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 
 
+// Format combinations to round trip
+static const uint32_t kFormats[] = {
+    mccomp::kFormatBase,
+    mccomp::kFormatLongTable,
+    mccomp::kFormatLineRef,
+    mccomp::kFormatLongTable | mccomp::kFormatLineRef,
+    mccomp::kFormatLongTable | mccomp::kFormatLineRef | mccomp::kFormatStored,
+};
+
+// The extensions keep their state in a FormatState, so the base format stays small.
+static_assert(sizeof(mccomp::Compressor) < 600 && sizeof(mccomp::Decompressor) < 600,
+    "Compressor and Decompressor are less than 600 bytes");
+
 #define RUN_TEST(test) printf("Test: %s\n", #test); test
 
 // Like assert(), but works in release mode too
@@ -39,6 +60,165 @@ void testTable()
     }
 }
 
+void testLongTable()
+{
+    mccomp::LongTable t;
+    const uint8_t ab[2] = { 'A', 'B' };
+    const uint8_t c = 'C';
+    const uint8_t cd[2] = { 'C', 'D' };
+    {
+        // AB C: pair then byte promotes ABC
+        t.push(ab, 2);
+        t.push(&c, 1);
+        const uint8_t abc[4] = { 'A', 'B', 'C', 'x' };
+        int i = t.fetch(abc, 4);
+        TEST(i >= 0 && i < mccomp::kLongTableSize);
+        uint8_t seq[mccomp::kLongMaxLength];
+        TEST(t.get(i, seq) == 3);
+        TEST(memcmp(seq, "ABC", 3) == 0);
+    }
+    {
+        // AB CD: pair then pair promotes ABCD, which is preferred over ABC
+        t.breakSequence();
+        t.push(ab, 2);
+        t.push(cd, 2);
+        int i = t.fetch((const uint8_t*)"ABCD", 4);
+        TEST(i >= 0);
+        uint8_t seq[mccomp::kLongMaxLength];
+        TEST(t.get(i, seq) == 4);
+        TEST(memcmp(seq, "ABCD", 4) == 0);
+    }
+    {
+        // Byte then byte is a pair, not a long sequence
+        mccomp::LongTable t2;
+        t2.push(&c, 1);
+        t2.push(&c, 1);
+        TEST(t2.fetch((const uint8_t*)"CCCC", 4) < 0);
+    }
+    {
+        // A token for an entry that isn't filled in is an error, and isn't consumed
+        const uint8_t corrupt[3] = { 'a', mccomp::kLongTableStart, 'b' };
+        mccomp::FormatState state;
+        mccomp::Decompressor d(false, mccomp::kFormatLongTable, &state);
+        uint8_t out[16];
+        mccomp::Result r = d.decompress(corrupt, sizeof(corrupt), out, sizeof(out));
+        TEST(r.error);
+        TEST(r.nInput == 1 && r.nOutput == 1);
+    }
+}
+
+void testLineHistory()
+{
+    mccomp::LineHistory h;
+    const char* text = "first line\nsecond line\npartial";
+    h.append((const uint8_t*)text, strlen(text));
+    TEST(!h.atLineStart());
+
+    const int all = mccomp::kLineAllRefs;
+    TEST(h.match(all, 0, (const uint8_t*)"second line\n", 12) == 1);
+    TEST(h.match(all, 0, (const uint8_t*)"first line\n", 11) == 2);
+    TEST(h.match(all, 0, (const uint8_t*)"third line\n", 11) == 0);
+    // A line is matched piece by piece, and not past its end
+    TEST(h.match(all, 0, (const uint8_t*)"s", 1) == 1);
+    TEST(h.match(1, 1, (const uint8_t*)"econd", 5) == 1);
+    TEST(h.match(2, 1, (const uint8_t*)"econd", 5) == 0);
+    TEST(h.match(all, 6, (const uint8_t*)"line\n", 5) == 2);
+    TEST(h.match(all, 11, (const uint8_t*)"\nx", 2) == 0);
+
+    TEST(h.mayRepeat(nullptr, 0, (const uint8_t*)"fir", 3));
+    TEST(!h.mayRepeat(nullptr, 0, (const uint8_t*)"fix", 3));
+    // The line in progress, once complete
+    TEST(h.mayRepeat((const uint8_t*)" line\n", 6, (const uint8_t*)"partial l", 9));
+    TEST(!h.mayRepeat((const uint8_t*)" line\n", 6, (const uint8_t*)"partial line\nx", 14));
+
+    uint32_t pos = 0;
+    int len = 0;
+    TEST(h.get(1, pos, len));
+    TEST(len == 11);
+    char buf[16];
+    h.read(pos, (uint8_t*)buf, len);
+    TEST(memcmp(buf, "first line\n", 11) == 0);
+}
+
+void testLineRef()
+{
+    // Repeated lines become 2 byte references, and decode with small output buffers.
+    const std::string line = "PowerManagerService: acquire lock=233570404, flags=0x1\n";
+    const std::string in = line + line + line;
+    const uint32_t format = mccomp::kFormatLineRef;
+
+    std::array<uint8_t, 256> compressed;
+    mccomp::FormatState cState;
+    mccomp::Compressor c(format, &cState);
+    mccomp::Result r = c.compress((const uint8_t*)in.data(), in.size(), compressed.data(), compressed.size());
+    TEST(r.nInput == int(in.size()));
+    TEST(compressed[r.nOutput - 4] == mccomp::kLiteral);
+    TEST(compressed[r.nOutput - 3] == mccomp::kLineRefStart);
+    TEST(compressed[r.nOutput - 2] == mccomp::kLiteral);
+    TEST(compressed[r.nOutput - 1] == mccomp::kLineRefStart);
+
+    const int compressedSize = r.nOutput;
+    std::string out;
+    mccomp::FormatState dState;
+    mccomp::Decompressor d(false, format, &dState);
+    int pos = 0;
+    while (pos < compressedSize || out.size() < in.size()) {
+        uint8_t buf[16];
+        r = d.decompress(compressed.data() + pos, compressedSize - pos, buf, sizeof(buf));
+        TEST(r.nInput > 0 || r.nOutput > 0);
+        out.append((const char*)buf, r.nOutput);
+        pos += r.nInput;
+    }
+    TEST(out == in);
+
+    // A reference at the end of the stream that doesn't fit in the output buffer
+    // isn't consumed until it is all written, so the usual loop gets all of it.
+    {
+        const std::string longLine = "ActivityManager: Start proc 12345:com.android.phone/u0a12 ok\n";
+        const std::string repeated = longLine + longLine;
+        TEST(repeated.size() == 122);
+        mccomp::FormatState cState2;
+        mccomp::Compressor c2(format, &cState2);
+        r = c2.compress((const uint8_t*)repeated.data(), repeated.size(), compressed.data(), compressed.size());
+        TEST(r.nInput == int(repeated.size()));
+        const int size2 = r.nOutput;
+
+        mccomp::FormatState dState2;
+        mccomp::Decompressor d2(false, format, &dState2);
+        std::string out2;
+        uint8_t buf[40];
+        pos = 0;
+        while (pos < size2) {
+            r = d2.decompress(compressed.data() + pos, size2 - pos, buf, sizeof(buf));
+            out2.append((const char*)buf, r.nOutput);
+            pos += r.nInput;
+        }
+        TEST(out2 == repeated);
+    }
+
+    // A reference to a line that isn't in the history is an error, and isn't consumed
+    {
+        const uint8_t corrupt[4] = { 'a', '\n', mccomp::kLiteral, mccomp::kLineRefStart + 1 };
+        mccomp::FormatState state;
+        mccomp::Decompressor d3(false, format, &state);
+        uint8_t buf[16];
+        r = d3.decompress(corrupt, sizeof(corrupt), buf, sizeof(buf));
+        TEST(r.error);
+        TEST(r.nInput == 2 && r.nOutput == 2);
+    }
+
+    // Without a FormatState, the extensions are an error
+    {
+        mccomp::Compressor c3(format);
+        uint8_t buf[16];
+        r = c3.compress((const uint8_t*)in.data(), in.size(), buf, sizeof(buf));
+        TEST(r.error && r.nInput == 0 && r.nOutput == 0);
+        mccomp::Decompressor d3(false, format);
+        r = d3.decompress(compressed.data(), compressedSize, buf, sizeof(buf));
+        TEST(r.error && r.nInput == 0 && r.nOutput == 0);
+    }
+}
+
 void testComp0()
 {
     const char* in = "ABAB";
@@ -63,6 +243,37 @@ void testComp1()
     TEST(out[1] == 'A');
 }
 
+void testRLEExactOutput()
+{
+    // A run at the end of the stream decompresses into an output buffer of exactly its size
+    const char* in = "AAAA";
+    uint8_t compressed[8];
+    mccomp::Compressor c;
+    mccomp::Result r = c.compress((const uint8_t*)in, 4, compressed, 8);
+    TEST(r.nOutput == 2);
+
+    uint8_t out[4];
+    mccomp::Decompressor d;
+    r = d.decompress(compressed, 2, out, 4);
+    TEST(r.nInput == 2);
+    TEST(r.nOutput == 4);
+    TEST(memcmp(out, in, 4) == 0);
+
+    // A marker split from its value, then too little output: the marker is kept,
+    // not handed back from the previous input.
+    mccomp::Decompressor split;
+    r = split.decompress(compressed, 1, out, 4);
+    TEST(r.nInput == 1);
+    TEST(r.nOutput == 0);
+    r = split.decompress(compressed + 1, 1, out, 3);
+    TEST(r.nInput == 0);
+    TEST(r.nOutput == 0);
+    r = split.decompress(compressed + 1, 1, out, 4);
+    TEST(r.nInput == 1);
+    TEST(r.nOutput == 4);
+    TEST(memcmp(out, in, 4) == 0);
+}
+
 void testSmallBinary()
 {
     std::array<uint8_t, 4> in = { 0, 255, 1, 254 };
@@ -98,21 +309,27 @@ void testBinary()
     for (int i = 0; i < 512; i++)
        in[i] = uint8_t(i);
 
-    std::array<uint8_t, 1024> compressed;
-    std::array<uint8_t, 512> out;
+    for (uint32_t format : kFormats) {
+        std::array<uint8_t, 1024> compressed;
+        std::array<uint8_t, 512> out;
 
-    mccomp::Compressor c;
-    mccomp::Result r = c.compress(in.data(), int(in.size()), compressed.data(), int(compressed.size()));
-    TEST(r.nInput == in.size());
-    TEST(r.nOutput <= compressed.size());
-    int compressedSize = r.nOutput;
+        mccomp::FormatState cState;
+        mccomp::Compressor c(format, &cState);
+        mccomp::Result r = c.compress(in.data(), int(in.size()), compressed.data(), int(compressed.size()));
+        TEST(r.nInput == in.size());
+        int compressedSize = r.nOutput;
+        r = c.flush(compressed.data() + compressedSize, compressed.size() - compressedSize);
+        compressedSize += r.nOutput;
+        TEST(size_t(compressedSize) <= compressed.size());
 
-    mccomp::Decompressor d;
-    r = d.decompress(compressed.data(), int(compressed.size()), out.data(), int(out.size()));
-    TEST(r.nInput == compressedSize);
-    TEST(r.nOutput == 512);
+        mccomp::FormatState dState;
+        mccomp::Decompressor d(false, format, &dState);
+        r = d.decompress(compressed.data(), int(compressed.size()), out.data(), int(out.size()));
+        TEST(r.nInput == compressedSize);
+        TEST(r.nOutput == 512);
 
-    TEST(out == in);
+        TEST(out == in);
+    }
 }
 
 void testEOF()
@@ -225,6 +442,13 @@ void canonTest()
                 pos += r.nInput;
             }
         }
+        // Only needed with kFormatLineRef, which can hold the start of a line back.
+        while (true) {
+            mccomp::Result r = comp.flush((uint8_t*)writeBuffer, kBufferSize);
+            if (r.nOutput == 0)
+                break;
+            compFile.write(writeBuffer, r.nOutput);
+        }
     }
     inFile.close();
     compFile.close();
@@ -252,6 +476,7 @@ void canonTest()
 
                 outFile.write(writeBuffer, r.nOutput);
                 pos += r.nInput;
+                TEST(!r.error);
             }
         }
     }
@@ -262,9 +487,663 @@ void canonTest()
     std::cout << "Canon test compression: " << 1.0 * compSize / inSize << "\n";
 }
 
-int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer1 = 40) 
+std::string readFile(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+// Compress all of data in one call
+std::string compressAll(const std::string& data, uint32_t format = mccomp::kFormatBase)
+{
+    std::string compressed(data.size() * 2 + 16, 0);
+    mccomp::FormatState state;
+    mccomp::Compressor c(format, &state);
+    mccomp::Result r = c.compress((const uint8_t*)data.data(), data.size(), (uint8_t*)&compressed[0], compressed.size());
+    TEST(r.nInput == int(data.size()));
+    const size_t size = r.nOutput;
+    r = c.flush((uint8_t*)&compressed[size], compressed.size() - size);
+    compressed.resize(size + r.nOutput);
+    return compressed;
+}
+
+// Entropy round trip with small, uneven buffers. Returns the encoded size.
+size_t entropyCycle(const std::string& data)
+{
+    std::string encoded;
+    {
+        mccomp::EntropyEncoder enc;
+        uint8_t buf[37];
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t n = std::min(size_t(1000), data.size() - pos);
+            mccomp::Result r = enc.encode((const uint8_t*)data.data() + pos, n, buf, sizeof(buf));
+            encoded.append((const char*)buf, r.nOutput);
+            pos += r.nInput;
+        }
+        while (true) {
+            mccomp::Result r = enc.finish(buf, sizeof(buf));
+            if (r.nOutput == 0)
+                break;
+            encoded.append((const char*)buf, r.nOutput);
+        }
+    }
+    std::string decoded;
+    {
+        mccomp::EntropyDecoder dec;
+        uint8_t buf[53];
+        size_t pos = 0;
+        while (true) {
+            size_t n = std::min(size_t(700), encoded.size() - pos);
+            mccomp::Result r = dec.decode((const uint8_t*)encoded.data() + pos, n, buf, sizeof(buf));
+            TEST(!dec.error());
+            decoded.append((const char*)buf, r.nOutput);
+            pos += r.nInput;
+            if (pos == encoded.size() && r.nOutput == 0)
+                break;
+        }
+    }
+    TEST(decoded == data);
+    return encoded.size();
+}
+
+void testEntropy()
+{
+    // Empty, single symbol, incompressible
+    TEST(entropyCycle("") == 0);
+    entropyCycle(std::string(100000, 'a'));
+    std::string binary;
+    for (int i = 0; i < 70000; i++)
+        binary.push_back(char((i * 7919) >> 3));
+    entropyCycle(binary);
+
+    for (const char* filename : { "test.log", "Android_2k.log", "Windows_2k.log" }) {
+        std::string data = readFile(filename);
+        TEST(!data.empty());
+        for (uint32_t format : { mccomp::kFormatBase, mccomp::kFormatLongTable | mccomp::kFormatLineRef }) {
+            std::string compressed = compressAll(data, format);
+            size_t size = entropyCycle(compressed);
+            printf("  %s format %u: mccomp %.1f%% entropy coded %.1f%%\n", filename, format,
+                100.0 * compressed.size() / data.size(), 100.0 * size / data.size());
+        }
+    }
+}
+
+// Delta transform all of data, with input and output buffers of the given sizes
+std::string deltaEncode(const std::string& data, size_t inSize, size_t outSize)
+{
+    std::string encoded;
+    std::vector<uint8_t> buf(outSize);
+    mccomp::DeltaEncoder enc;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t n = std::min(inSize, data.size() - pos);
+        mccomp::Result r = enc.encode((const uint8_t*)data.data() + pos, n, buf.data(), buf.size());
+        encoded.append((const char*)buf.data(), r.nOutput);
+        pos += r.nInput;
+    }
+    return encoded;
+}
+
+std::string deltaDecode(const std::string& data, size_t inSize, size_t outSize)
+{
+    std::string decoded;
+    std::vector<uint8_t> buf(outSize);
+    mccomp::DeltaDecoder dec;
+    size_t pos = 0;
+    while (true) {
+        size_t n = std::min(inSize, data.size() - pos);
+        mccomp::Result r = dec.decode((const uint8_t*)data.data() + pos, n, buf.data(), buf.size());
+        TEST(!dec.error());
+        decoded.append((const char*)buf.data(), r.nOutput);
+        pos += r.nInput;
+        if (pos == data.size() && r.nOutput == 0)
+            break;
+    }
+    return decoded;
+}
+
+void testDelta()
+{
+    {
+        const std::string in =
+            "03-17 16:13:38.811  1702  2395 D WindowManager: a\n"
+            "03-17 16:13:38.819  1702  8671 D PowerManagerService: b\n"
+            "03-17 16:13:39.002  1702 18671 D PowerManagerService: c\n"
+            "\v starts with a marker\n"
+            "\f starts with an escape\n"
+            "\n"
+            "12345678901234 too many digits\n"
+            "12345678901235 too many digits\n"
+            "7\n"
+            "8";
+        std::string encoded = deltaEncode(in, 1000, 1000);
+        TEST(encoded.size() < in.size());
+        // Second line: all 8 fields, only the milliseconds (+8) and TID change
+        TEST(encoded.compare(50, 10, "\vIAAAAAaBA") == 0);
+        TEST(deltaDecode(encoded, 1000, 1000) == in);
+        // Small buffers
+        for (size_t i = 1; i < 20; i += 3) {
+            TEST(deltaDecode(encoded, i, 20 - i) == in);
+            TEST(deltaDecode(deltaEncode(in, i + 2, i + 1), i, i) == in);
+        }
+    }
+    for (const char* filename : { "test.log", "Android_2k.log", "Windows_2k.log" }) {
+        std::string data = readFile(filename);
+        std::string encoded = deltaEncode(data, 100, 40);
+        TEST(deltaDecode(encoded, 40, 16) == data);
+    }
+}
+
+// Ratio and speed of the delta transform + Compressor on the bundled logs
+void benchDelta()
 {
-    static constexpr int kBufferAlloc = 40;
+    for (const char* filename : { "Android_2k.log", "Windows_2k.log" }) {
+        std::string data = readFile(filename);
+        for (uint32_t format : { mccomp::kFormatBase, mccomp::kFormatLongTable | mccomp::kFormatLineRef }) {
+            auto t0 = std::chrono::steady_clock::now();
+            std::string plain = compressAll(data, format);
+            auto t1 = std::chrono::steady_clock::now();
+            std::string delta = compressAll(deltaEncode(data, 4096, 4096), format);
+            auto t2 = std::chrono::steady_clock::now();
+
+            printf("  %s format %u: %.1f%% %.2fms, with delta %.1f%% %.2fms\n", filename, format,
+                100.0 * plain.size() / data.size(), std::chrono::duration<double, std::milli>(t1 - t0).count(),
+                100.0 * delta.size() / data.size(), std::chrono::duration<double, std::milli>(t2 - t1).count());
+        }
+    }
+}
+
+void testColumnar()
+{
+    {
+        // Short lines, empty lines, and no '\n' at the end
+        const std::string in =
+            "03-17 16:13:38.811  1702  2395 D WindowManager: a\n"
+            "03-17 16:13:38.819  1702  8671 D PowerManagerService: b: c\n"
+            "\n"
+            "short\n"
+            "no newline";
+        std::vector<uint8_t> stream = mccomp::columnCompress((const uint8_t*)in.data(), in.size(), mccomp::kLogcatColumns);
+        TEST(mccomp::columnCount(stream.data(), stream.size()) == 4);
+
+        std::vector<uint8_t> out;
+        TEST(mccomp::columnDecompressAll(stream.data(), stream.size(), out));
+        TEST(std::string(out.begin(), out.end()) == in);
+
+        // Only the tags
+        TEST(mccomp::columnDecompress(stream.data(), stream.size(), 2, out));
+        TEST(std::string(out.begin(), out.end()) == "WindowManager:\nPowerManagerService:\n\n\n\n");
+        TEST(!mccomp::columnDecompress(stream.data(), stream.size(), 4, out));
+
+        // A raw size of about 4GB in the header is an error, not an allocation
+        stream[mccomp::kColumnHeaderSize + 3] = 0xf0;
+        const bool huge = mccomp::columnDecompressAll(stream.data(), stream.size(), out);
+        TEST(!huge);
+    }
+    {
+        // Everything fits in the first column, so the last one is empty
+        const std::string in = "03-17 16:13:38.811";
+        std::vector<uint8_t> stream = mccomp::columnCompress((const uint8_t*)in.data(), in.size(), mccomp::kLogcatColumns);
+        std::vector<uint8_t> out;
+        const bool ok = mccomp::columnDecompressAll(stream.data(), stream.size(), out);
+        TEST(ok);
+        TEST(std::string(out.begin(), out.end()) == in);
+    }
+    struct Corpus {
+        const char* filename;
+        mccomp::ColumnLayout layout;
+    };
+    for (const Corpus& corpus : { Corpus{ "Android_2k.log", mccomp::kLogcatColumns }, Corpus{ "Windows_2k.log", mccomp::kCbsColumns } }) {
+        std::string data = readFile(corpus.filename);
+        for (uint32_t format : { mccomp::kFormatBase, mccomp::kFormatLongTable | mccomp::kFormatLineRef }) {
+            std::vector<uint8_t> stream = mccomp::columnCompress((const uint8_t*)data.data(), data.size(), corpus.layout, format);
+            std::vector<uint8_t> out;
+            TEST(mccomp::columnDecompressAll(stream.data(), stream.size(), out));
+            TEST(std::string(out.begin(), out.end()) == data);
+            printf("  %s format %u: single stream %.1f%% columnar %.1f%%\n", corpus.filename, format,
+                100.0 * compressAll(data, format).size() / data.size(), 100.0 * stream.size() / data.size());
+        }
+    }
+}
+
+// Sink that appends to a std::string with write()
+bool stringWrite(void* user, const uint8_t* data, size_t n)
+{
+    static_cast<std::string*>(user)->append((const char*)data, n);
+    return true;
+}
+
+// Sink that gives out the spare capacity of a std::string with acquire()
+struct StringSpan {
+    std::string str;
+    size_t size = 0;
+};
+
+uint8_t* spanAcquire(void* user, size_t minSize, size_t* size)
+{
+    StringSpan* span = static_cast<StringSpan*>(user);
+    if (span->str.size() - span->size < minSize)
+        span->str.resize(span->str.size() * 2 + minSize);
+    *size = span->str.size() - span->size;
+    return (uint8_t*)&span->str[span->size];
+}
+
+void spanCommit(void* user, size_t n)
+{
+    static_cast<StringSpan*>(user)->size += n;
+}
+
+// Compress and decompress data with small, uneven buffers. Returns the compressed size.
+size_t smallBufferCycle(const std::string& data, uint32_t format, size_t inSize, size_t outSize)
+{
+    std::string compressed;
+    {
+        mccomp::FormatState state;
+        mccomp::Compressor c(format, &state);
+        std::vector<uint8_t> buf(outSize);
+        size_t pos = 0;
+        while (pos < data.size()) {
+            mccomp::Result r = c.compress((const uint8_t*)data.data() + pos, std::min(inSize, data.size() - pos), buf.data(), buf.size());
+            compressed.append((const char*)buf.data(), r.nOutput);
+            pos += r.nInput;
+        }
+        for (;;) {
+            mccomp::Result r = c.flush(buf.data(), buf.size());
+            if (r.nOutput == 0)
+                break;
+            compressed.append((const char*)buf.data(), r.nOutput);
+        }
+    }
+    std::string out;
+    {
+        mccomp::FormatState state;
+        mccomp::Decompressor d(false, format, &state);
+        std::vector<uint8_t> buf(inSize);
+        size_t pos = 0;
+        while (out.size() < data.size()) {
+            mccomp::Result r = d.decompress((const uint8_t*)compressed.data() + pos, std::min(outSize, compressed.size() - pos), buf.data(), buf.size());
+            TEST(r.nInput > 0 || r.nOutput > 0);
+            out.append((const char*)buf.data(), r.nOutput);
+            pos += r.nInput;
+        }
+        TEST(pos == compressed.size());
+    }
+    TEST(out == data);
+    return compressed.size();
+}
+
+// Lines are matched across small input buffers, and a line that turns out not to be
+// a repeat, late or at the end of the stream, is written from the history.
+void testLineRefStream()
+{
+    const uint32_t format = mccomp::kFormatLineRef;
+    const std::string line = "PowerManagerService: acquire lock=233570404, flags=0x1\n";
+    const std::string almost = line.substr(0, line.size() - 2) + "2\n";
+    const std::string repeated = line + line + line;
+    const std::string mixed = line + line + almost + line + line.substr(0, 30);
+    for (size_t inSize : { size_t(7), size_t(40) }) {
+        const size_t size = smallBufferCycle(repeated, format, inSize, 5);
+        TEST(size == compressAll(repeated, format).size());
+        TEST(size == compressAll(line, format).size() + 4);
+        const size_t mixedSize = smallBufferCycle(mixed, format, inSize, 5);
+        TEST(mixedSize == compressAll(mixed, format).size());
+    }
+}
+
+void testEstimate()
+{
+    std::vector<std::pair<std::string, std::string>> corpus;
+    for (const char* filename : { "test.log", "Android_2k.log", "Windows_2k.log" })
+        corpus.push_back({ filename, readFile(filename) });
+    std::string random;
+    uint32_t seed = 1;
+    for (int i = 0; i < 100000; i++) {
+        seed = seed * 1103515245 + 12345;
+        random.push_back(char(seed >> 24));
+    }
+    corpus.push_back({ "random", random });
+    std::string utf8;
+    for (int i = 0; i < 10000; i++)
+        utf8 += "\xe6\x97\xa5\xe5\xbf\x97 ";
+    corpus.push_back({ "utf8", utf8 });
+    corpus.push_back({ "mixed", corpus[1].second.substr(0, 100000) + random });
+
+    for (const auto& c : corpus) {
+        const uint8_t* data = (const uint8_t*)c.second.data();
+        for (uint32_t format : { mccomp::kFormatBase, mccomp::kFormatStored }) {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            const float estimate = mccomp::estimateRatio(data, c.second.size(), format);
+            auto t1 = std::chrono::high_resolution_clock::now();
+            const size_t size = compressAll(c.second, format).size();
+            auto t2 = std::chrono::high_resolution_clock::now();
+            const float actual = float(size) / c.second.size();
+            TEST(std::abs(estimate - actual) < 0.05f);
+            printf("  %s format %u: estimate %.1f%% actual %.1f%%, %.3f ms vs %.3f ms\n", c.first.c_str(), format,
+                100.0 * estimate, 100.0 * actual,
+                std::chrono::duration<double, std::milli>(t1 - t0).count(),
+                std::chrono::duration<double, std::milli>(t2 - t1).count());
+        }
+    }
+
+    // A stored block ends where text starts
+    {
+        std::string in = random.substr(0, 200);
+        for (char& ch : in)
+            ch = char(ch | 0x80);
+        in += " (Greek) and then a line of text\n";
+        const std::string compressed = compressAll(in, mccomp::kFormatStored);
+        TEST(uint8_t(compressed[0]) == mccomp::kLiteral);
+        TEST(uint8_t(compressed[1]) == mccomp::kStoredToken);
+        TEST(uint8_t(compressed[2]) == 200);
+    }
+    // Stored blocks bound the size of binary data
+    TEST(compressAll(random, mccomp::kFormatBase).size() > random.size() * 3 / 2);
+    TEST(compressAll(random, mccomp::kFormatStored).size() < random.size() * 102 / 100);
+    // including escapes between short runs of text. The worst case is 3 escapes, which
+    // cost as much as a block, then kStoredTextRun plain bytes, with 40 byte inputs or more.
+    for (int escapes = 1; escapes <= 16; escapes++) {
+        for (int plain = 1; plain <= 40; plain++) {
+            std::string in;
+            for (size_t i = 0; in.size() < 4000; i += escapes + plain) {
+                for (int j = 0; j < escapes + plain; j++) {
+                    const uint8_t byte = uint8_t(random[i + j]);
+                    in.push_back(char(j < escapes ? byte | 0x80 : ' ' + byte % 95));
+                }
+            }
+            const size_t bound = in.size() * (mccomp::kStoredTextRun + 3) / mccomp::kStoredTextRun;
+            TEST(compressAll(in, mccomp::kFormatStored).size() <= bound);
+            TEST(smallBufferCycle(in, mccomp::kFormatStored, 40, 64) <= bound);
+        }
+    }
+    // and split across calls
+    const std::string mixed = corpus[0].second + random.substr(0, 5000) + corpus[0].second;
+    for (uint32_t format : { mccomp::kFormatStored, mccomp::kFormatLongTable | mccomp::kFormatLineRef | mccomp::kFormatStored }) {
+        TEST(smallBufferCycle(mixed, format, 37, 23) < compressAll(mixed, format & ~mccomp::kFormatStored).size());
+        smallBufferCycle(mixed, format, 1000, 300);
+        smallBufferCycle(random, format, 301, 64);
+    }
+}
+
+void testStream()
+{
+    const std::string data = readFile("test.log");
+    for (uint32_t format : kFormats) {
+        // Compress with a write() sink, in uneven chunks
+        std::string compressed;
+        {
+            mccomp::Sink sink;
+            sink.write = stringWrite;
+            sink.user = &compressed;
+            mccomp::FormatState state;
+            mccomp::StreamCompressor stream(sink, format, &state);
+            for (size_t pos = 0, n = 1; pos < data.size(); pos += n, n = n % 97 + 1) {
+                const bool ok = stream.write((const uint8_t*)data.data() + pos, std::min(n, data.size() - pos));
+                TEST(ok);
+            }
+            const bool flushed = stream.flush();
+            TEST(flushed);
+        }
+        // Decompress straight into the string's buffer, again in uneven chunks
+        {
+            StringSpan span;
+            mccomp::Sink sink;
+            sink.acquire = spanAcquire;
+            sink.commit = spanCommit;
+            sink.user = &span;
+            mccomp::FormatState state;
+            mccomp::StreamDecompressor stream(sink, false, format, &state);
+            for (size_t pos = 0, n = 1; pos < compressed.size(); pos += n, n = n % 13 + 1) {
+                const bool ok = stream.write((const uint8_t*)compressed.data() + pos, std::min(n, compressed.size() - pos));
+                TEST(ok);
+            }
+            const bool flushed = stream.flush();
+            TEST(flushed);
+            span.str.resize(span.size);
+            TEST(span.str == data);
+        }
+        // Flash: stop at 0xff
+        {
+            std::string out;
+            mccomp::Sink sink;
+            sink.write = stringWrite;
+            sink.user = &out;
+            mccomp::FormatState state;
+            mccomp::StreamDecompressor stream(sink, true, format, &state);
+            const std::string flash = compressed + std::string(100, char(0xff));
+            const bool ok = stream.write((const uint8_t*)flash.data(), flash.size());
+            TEST(ok);
+            TEST(stream.eof());
+            const bool flushed = stream.flush();
+            TEST(flushed);
+            TEST(out == data);
+        }
+    }
+    // A failing sink fails the stream
+    {
+        mccomp::Sink sink;
+        sink.write = [](void*, const uint8_t*, size_t) { return false; };
+        mccomp::StreamCompressor stream(sink);
+        const bool ok = stream.write((const uint8_t*)data.data(), data.size());
+        TEST(!ok);
+    }
+}
+
+void testArchive()
+{
+    static const char* kFilename = "test-archive.dat";
+    std::vector<std::string> names;
+    std::vector<std::string> files;
+    for (const char* filename : { "test.log", "Android_2k.log", "Windows_2k.log" }) {
+        names.push_back(filename);
+        files.push_back(readFile(filename));
+    }
+    // Empty, and large enough for several segments
+    names.push_back("empty");
+    files.push_back("");
+    names.push_back("large");
+    files.push_back(files[1] + files[2] + files[1] + files[2]);
+    TEST(files.back().size() > 3 * mccomp::kArchiveSegmentSize);
+    // Many small files, like rotated logs
+    for (int i = 0; i < 500; i++) {
+        names.push_back("small" + std::to_string(i));
+        files.push_back(files[1].substr(i * 300, 100 + (i * 37) % 900));
+    }
+
+    size_t total = 0;
+    for (const std::string& file : files)
+        total += file.size();
+
+    for (uint32_t format : { mccomp::kFormatBase, mccomp::kFormatLongTable | mccomp::kFormatLineRef }) {
+        mccomp::ArchiveBuilder builder(format);
+        for (size_t i = 0; i < files.size(); i++)
+            builder.add(names[i], (const uint8_t*)files[i].data(), files[i].size());
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        const std::vector<uint8_t> archive = builder.build(1);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        const std::vector<uint8_t> archive4 = builder.build(4);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        TEST(archive4 == archive);
+
+        mccomp::ArchiveReader reader;
+        const bool read = reader.readManifest(archive.data(), archive.size());
+        TEST(read);
+        TEST(reader.count() == int(files.size()));
+        TEST(reader.member(reader.find("large")).nSegments == 5);
+        TEST(reader.find("missing") == -1);
+
+        std::vector<std::vector<uint8_t>> out;
+        const bool extracted = reader.extractAll(archive.data(), archive.size(), out, 4);
+        TEST(extracted);
+        for (size_t i = 0; i < files.size(); i++) {
+            TEST(std::string(out[i].begin(), out[i].end()) == files[i]);
+        }
+
+        // One member, from a copy of just its bytes
+        const mccomp::ArchiveMember& member = reader.member(reader.find("Windows_2k.log"));
+        std::vector<uint8_t> range(archive.begin() + member.offset, archive.begin() + member.offset + member.compressedSize);
+        std::vector<uint8_t> one;
+        const bool extractedOne = reader.extract(reader.find("Windows_2k.log"), range.data(), one);
+        TEST(extractedOne);
+        TEST(std::string(one.begin(), one.end()) == files[2]);
+
+        FILE* fp = fopen(kFilename, "wb");
+        fwrite(archive.data(), 1, archive.size(), fp);
+        fclose(fp);
+        const bool fromFile = mccomp::archiveExtractFile(kFilename, "large", one);
+        TEST(fromFile);
+        TEST(std::string(one.begin(), one.end()) == files[4]);
+        const bool missing = mccomp::archiveExtractFile(kFilename, "missing", one);
+        TEST(!missing);
+
+        // Cut off
+        const bool cutAll = reader.extractAll(archive.data(), archive.size() - 1, out);
+        TEST(!cutAll);
+        const bool cutManifest = reader.readManifest(archive.data(), 20);
+        TEST(!cutManifest);
+
+        // Corrupt sizes are caught before they are allocated
+        {
+            std::vector<uint8_t> bad = archive;
+            auto get32 = [&](size_t pos) {
+                return uint32_t(bad[pos] | (bad[pos + 1] << 8) | (bad[pos + 2] << 16) | (uint32_t(bad[pos + 3]) << 24));
+            };
+            auto put32 = [&](size_t pos, uint32_t v) {
+                for (int k = 0; k < 4; k++) {
+                    bad[pos + k] = uint8_t(v >> (8 * k));
+                }
+            };
+            // The first segment of the first member, and the member to match
+            const size_t memberPos = mccomp::kArchiveHeaderSize + 2 + names[0].size();
+            const size_t segmentPos = get32(9) - 8 * size_t(get32(5));
+            const uint32_t huge = 0xf0000000;
+            put32(memberPos, get32(memberPos) - get32(segmentPos) + huge);
+            put32(segmentPos, huge);
+            const bool hugeSegment = reader.readManifest(bad.data(), bad.size());
+            TEST(!hugeSegment);
+
+            // A header that claims a 4GB manifest
+            put32(9, 0xfffffff0);
+            fp = fopen(kFilename, "wb");
+            fwrite(bad.data(), 1, mccomp::kArchiveHeaderSize, fp);
+            fclose(fp);
+            const bool hugeManifest = mccomp::archiveExtractFile(kFilename, "large", one);
+            TEST(!hugeManifest);
+        }
+
+        printf("  format %u: %zu files, %.1f%%, build 1 thread %.1f ms, 4 threads %.1f ms\n", format, files.size(),
+            100.0 * archive.size() / total,
+            std::chrono::duration<double, std::milli>(t1 - t0).count(),
+            std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+    remove(kFilename);
+}
+
+// Read everything new from the follower
+std::string followRead(mccomp::Follower& follower)
+{
+    std::string out;
+    uint8_t buf[29];
+    while (size_t n = follower.read(buf, sizeof(buf)))
+        out.append((const char*)buf, n);
+    return out;
+}
+
+void testFollow()
+{
+    static const char* kFilename = "test-follow.dat";
+    const std::string data = readFile("test.log");
+    for (uint32_t format : kFormats) {
+        const std::string compressed = compressAll(data, format);
+
+        // Flash: the file is all 0xff, and written in place.
+        {
+            FILE* fp = fopen(kFilename, "wb");
+            std::string erased(compressed.size() + 100, char(0xff));
+            fwrite(erased.data(), 1, erased.size(), fp);
+            fclose(fp);
+
+            mccomp::Follower follower(format);
+            const bool opened = follower.open(kFilename);
+            TEST(opened);
+            const std::string first = followRead(follower);
+            TEST(first.empty());
+
+            std::string out;
+            fp = fopen(kFilename, "r+b");
+            for (size_t pos = 0; pos < compressed.size(); pos += 37) {
+                // Uneven writes split tokens
+                const size_t n = std::min(size_t(37), compressed.size() - pos);
+                fseek(fp, long(pos), SEEK_SET);
+                fwrite(compressed.data() + pos, 1, n, fp);
+                fflush(fp);
+                out += followRead(follower);
+            }
+            fclose(fp);
+            TEST(out == data);
+        }
+        // Appended to, then replaced by a shorter file
+        {
+            FILE* fp = fopen(kFilename, "wb");
+            fclose(fp);
+
+            mccomp::Follower follower(format, false);
+            const bool opened = follower.open(kFilename);
+            TEST(opened);
+            const bool changed = follower.wait(0);
+            TEST(!changed);
+
+            std::string out;
+            fp = fopen(kFilename, "ab");
+            for (size_t pos = 0; pos < compressed.size(); pos += 1000) {
+                const size_t n = std::min(size_t(1000), compressed.size() - pos);
+                fwrite(compressed.data() + pos, 1, n, fp);
+                fflush(fp);
+                follower.wait(0);
+                out += followRead(follower);
+            }
+            fclose(fp);
+            TEST(out == data);
+
+            const std::string restarted = "Restarted\n";
+            fp = fopen(kFilename, "wb");
+            fwrite(restarted.data(), 1, restarted.size(), fp);
+            fclose(fp);
+            const std::string afterRestart = followRead(follower);
+            TEST(afterRestart == restarted);
+        }
+    }
+    remove(kFilename);
+}
+
+// Print a compressed log as it grows, like `tail -f`. Doesn't return.
+int follow(const char* filename, uint32_t format)
+{
+    mccomp::Follower follower(format);
+    if (!follower.open(filename)) {
+        std::cerr << "Error: Could not open file '" << filename << "'" << std::endl;
+        return 1;
+    }
+    uint8_t buf[4096];
+    while (true) {
+        size_t n = follower.read(buf, sizeof(buf));
+        if (n) {
+            fwrite(buf, 1, n, stdout);
+            fflush(stdout);
+        }
+        else {
+            follower.wait(1000);
+        }
+    }
+}
+
+int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer1 = 40,
+    uint32_t format = mccomp::kFormatBase)
+{
+    static constexpr int kBufferAlloc = 1024;
     assert(buffer0 <= kBufferAlloc);
     assert(buffer1 <= kBufferAlloc);
 
@@ -275,7 +1154,8 @@ int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer
         memset(workingIn, 0, kBufferAlloc + 1);
         memset(workingOut, 0, kBufferAlloc + 1);
 
-        mccomp::Compressor compressor;
+        mccomp::FormatState state;
+        mccomp::Compressor compressor(format, &state);
 
         // Iterate over the input stream.
         size_t pos = 0;
@@ -301,6 +1181,14 @@ int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer
             }
             pos += r.nInput;
         }
+        // Write out the start of a line that was held while it could be a repeat.
+        for (;;) {
+            mccomp::Result r = compressor.flush(workingOut, buffer1);
+            assert(workingOut[buffer1] == 0);
+            if (r.nOutput == 0)
+                break;
+            compressed.insert(compressed.end(), workingOut, workingOut + r.nOutput);
+        }
     }
     std::string uncompressed;
     {
@@ -309,7 +1197,8 @@ int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer
         memset(workingIn, 0, kBufferAlloc + 1);
         memset(workingOut, 0, kBufferAlloc + 1);
 
-        mccomp::Decompressor decompressor;
+        mccomp::FormatState state;
+        mccomp::Decompressor decompressor(false, format, &state);
 
         // Iterate over the output stream size.
         // If known, could alternatively use the input stream size.
@@ -330,6 +1219,7 @@ int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer
             for (size_t i = 0; i < r.nOutput; i++)
                 uncompressed.push_back(workingOut[i]);
             pos += r.nInput;
+            TEST(!r.error);
         }
 
         if (log) {
@@ -341,6 +1231,10 @@ int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer
             std::cout << "Uncompressed: " << uncompressed.size() << " Compressed: " << compressed.size() << " bytes" << std::endl;
             std::cout << "Ratio%: " << 100.0 * compressed.size() / uncompressed.size() << std::endl;
             std::cout << "Utilization: nEntries = " << nEntries << " / " << mccomp::kTableSize << " nTotal = " << nTotal << "\n";
+            if (format & mccomp::kFormatLongTable) {
+                decompressor.longUtilization(nEntries, nTotal);
+                std::cout << "Long utilization: nEntries = " << nEntries << " / " << mccomp::kLongTableSize << " nTotal = " << nTotal << "\n";
+            }
         }
         // Verify that decompressed data matches original data
         if (uncompressed != fileContent) {
@@ -368,17 +1262,35 @@ int cycle(const std::string& fileContent, bool log, int buffer0 = 40, int buffer
 }
 
 int main(int argc, char* argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+        return follow(argv[2], argc >= 4 ? uint32_t(atoi(argv[3])) : mccomp::kFormatBase);
+    }
+
     RUN_TEST(testTable());
+    RUN_TEST(testLongTable());
+    RUN_TEST(testLineHistory());
+    RUN_TEST(testLineRef());
+    RUN_TEST(testLineRefStream());
 	RUN_TEST(testComp0());
     RUN_TEST(testComp1());
+    RUN_TEST(testRLEExactOutput());
 	RUN_TEST(testSmallBinary());
     RUN_TEST(testBinary());
     RUN_TEST(canonTest());
     RUN_TEST(testEOF());
+    RUN_TEST(testStream());
+    RUN_TEST(testEstimate());
+    RUN_TEST(testEntropy());
+    RUN_TEST(testDelta());
+    RUN_TEST(benchDelta());
+    RUN_TEST(testColumnar());
+    RUN_TEST(testFollow());
+    RUN_TEST(testArchive());
 
     // Check if filename was provided as argument
     if (argc != 2) {
         std::cerr << "Usage: " << argv[0] << " <filename>" << std::endl;
+        std::cerr << "       " << argv[0] << " -f <compressed file> [format]" << std::endl;
         return 1;
     }
     
@@ -400,14 +1312,29 @@ int main(int argc, char* argv[]) {
     std::cout << "File size: " << sz << " bytes" << std::endl;
     file.close();
     
-    int rc = cycle(fileContent, true);
+    int rc = 0;
+    for (uint32_t format : kFormats) {
+        std::cout << "Format: " << format << std::endl;
+        rc = cycle(fileContent, true, 40, 40, format);
+        if (rc)
+            return rc;
+    }
+
+    // Large input buffers hold whole lines, so line references are found, and
+    // then split across small output buffers.
+    for (uint32_t format : kFormats) {
+        if (rc == 0)
+            rc = cycle(fileContent, false, 1024, 40, format);
+    }
 
     // Check different buffer sizes.
-    for (int i = 16; i < 40; i += 3) {
-        for (int j = 16; j < 40; j += 4) {
-            rc = cycle(fileContent, false, i, j);
-            if (rc)
-                break;
+    for (int i = 16; i < 40 && rc == 0; i += 3) {
+        for (int j = 16; j < 40 && rc == 0; j += 4) {
+            for (uint32_t format : kFormats) {
+                rc = cycle(fileContent, false, i, j, format);
+                if (rc)
+                    break;
+            }
         }
     }
 
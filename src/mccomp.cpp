@@ -92,6 +92,186 @@ void Table::utilization(int& nUsed, int& nTotal) const
     }
 }
 
+void LongTable::push(const uint8_t* seq, int len)
+{
+    assert(len > 0 && len <= kLongMaxLength);
+
+    // Same rolling age down as Table, but slower: there are far fewer
+    // tokens than bytes, and far fewer entries.
+    _count++;
+    if (_count % kAgeRate == 0) {
+        const int ageIndex = (_count / kAgeRate) % kLongTableSize;
+        if (_table[ageIndex].count > 0) {
+            _table[ageIndex].count--;
+        }
+    }
+
+    if (len >= kLongMinLength) {
+        // A long token was used; reinforce it.
+        const int idx = hash(seq, len);
+        if (_table[idx].match(seq, len) && _table[idx].count < UINT16_MAX) {
+            _table[idx].count++;
+        }
+        _prevLen = 0;
+        return;
+    }
+
+    const int combinedLen = _prevLen + len;
+    if (combinedLen >= kLongMinLength) {
+        // Both tokens are at most 2 bytes, so at least one is a pair.
+        uint8_t combined[kLongMaxLength];
+        memcpy(combined, _prev, _prevLen);
+        memcpy(combined + _prevLen, seq, len);
+
+        Entry& entry = _table[hash(combined, combinedLen)];
+        if (entry.count == 0) {
+            memcpy(entry.seq, combined, combinedLen);
+            entry.len = uint8_t(combinedLen);
+            entry.count = 1;
+        }
+        else if (entry.match(combined, combinedLen)) {
+            if (entry.count < UINT16_MAX) {
+                entry.count++;
+            }
+        }
+    }
+    memcpy(_prev, seq, len);
+    _prevLen = len;
+}
+
+int LongTable::fetch(const uint8_t* seq, int len) const
+{
+    for (int n = std::min(len, kLongMaxLength); n >= kLongMinLength; n--) {
+        const int idx = hash(seq, n);
+        if (_table[idx].match(seq, n)) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+int LongTable::get(int idx, uint8_t* seq) const
+{
+    assert(idx >= 0 && idx < kLongTableSize);
+    const Entry& entry = _table[idx];
+    memcpy(seq, entry.seq, entry.len);
+    return entry.len;
+}
+
+void LongTable::utilization(int& nUsed, int& nTotal) const
+{
+    nUsed = 0;
+    nTotal = 0;
+    for (const auto& entry : _table) {
+        if (entry.count > 0) {
+            nUsed++;
+        }
+        nTotal += entry.count;
+    }
+}
+
+void LineHistory::append(const uint8_t* data, size_t size)
+{
+    static_assert((kLineHistorySize & (kLineHistorySize - 1)) == 0, "history size must be a power of 2");
+
+    for (size_t i = 0; i < size; i++) {
+        const uint8_t byte = data[i];
+        _buf[_head % kLineHistorySize] = byte;
+        _head++;
+
+        if (byte == '\n') {
+            const int len = int(_head - _lineStart);
+            if (len >= kLineMinLength && len <= kLineHistorySize) {
+                _newest = (_newest + 1) % kLineSlots;
+                _lines[_newest] = { _lineStart, len };
+            }
+            _lineStart = _head;
+        }
+    }
+}
+
+int LineHistory::match(int refs, int offset, const uint8_t* data, int len) const
+{
+    int result = 0;
+    for (int ref = 0; ref < kLineSlots; ref++) {
+        const Line& entry = _lines[(_newest + kLineSlots - ref) % kLineSlots];
+        if (!(refs & (1 << ref)) || !valid(entry) || offset + len > entry.len) {
+            continue;
+        }
+        const int start = int((entry.pos + offset) % kLineHistorySize);
+        const int n0 = std::min(len, kLineHistorySize - start);
+        if (memcmp(_buf.data() + start, data, n0) == 0 && memcmp(_buf.data(), data + n0, len - n0) == 0) {
+            result |= 1 << ref;
+        }
+    }
+    return result;
+}
+
+bool LineHistory::mayRepeat(const uint8_t* tail, int tailLen, const uint8_t* next, int len) const
+{
+    if (match(kLineAllRefs, 0, next, len) != 0) {
+        return true;
+    }
+    const int head = int(_head - _lineStart);
+    const int lineLen = head + tailLen;
+    if (lineLen < kLineMinLength || lineLen > kLineHistorySize || len > lineLen) {
+        return false;
+    }
+    for (int i = 0; i < len; i++) {
+        const uint8_t byte = i < head ? _buf[(_lineStart + i) % kLineHistorySize] : tail[i - head];
+        if (byte != next[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void LineHistory::appendLine(int ref)
+{
+    uint32_t pos = 0;
+    int len = 0;
+    if (!get(ref, pos, len)) {
+        return;
+    }
+    // Appending overwrites the oldest bytes, which are before the line.
+    uint8_t buf[64];
+    for (int done = 0; done < len; ) {
+        const int n = std::min(len - done, int(sizeof(buf)));
+        read(pos + done, buf, n);
+        append(buf, n);
+        done += n;
+    }
+}
+
+bool LineHistory::get(int ref, uint32_t& pos, int& len) const
+{
+    assert(ref >= 0 && ref < kLineSlots);
+    const Line& entry = _lines[(_newest + kLineSlots - ref) % kLineSlots];
+    if (!valid(entry)) {
+        return false;
+    }
+    pos = entry.pos;
+    len = entry.len;
+    return true;
+}
+
+void LineHistory::read(uint32_t pos, uint8_t* out, int n) const
+{
+    const int start = int(pos % kLineHistorySize);
+    const int n0 = std::min(n, kLineHistorySize - start);
+    memcpy(out, _buf.data() + start, n0);
+    memcpy(out + n0, _buf.data(), n - n0);
+}
+
+Compressor::Compressor(uint32_t format, FormatState* state)
+    : _format(format),
+    _state(state)
+{
+    if (_state) {
+        *_state = FormatState();
+    }
+}
+
 int Compressor::writeRLE(const uint8_t* input, const uint8_t* inputEnd, uint8_t* out, const uint8_t* outputEnd)
 {
     // Check if we have space for RLE marker + value (2 bytes minimum)
@@ -116,6 +296,56 @@ int Compressor::writeRLE(const uint8_t* input, const uint8_t* inputEnd, uint8_t*
     return 0;
 }
 
+int Compressor::blockLength(const uint8_t* input, int maxLen, int plainRun) const
+{
+    // Up to plainRun plain bytes in a row, without the plain bytes at the end
+    int len = maxLen;
+    for (int i = 0, plain = 0; i < maxLen; i++) {
+        plain = isPlain(input[i], _format) ? plain + 1 : 0;
+        if (plain == plainRun) {
+            len = i + 1 - plain;
+            break;
+        }
+    }
+    while (len > 0 && isPlain(input[len - 1], _format)) {
+        len--;
+    }
+    return len;
+}
+
+int Compressor::writeStored(const uint8_t* input, const uint8_t* inputEnd, uint8_t* out, const uint8_t* outputEnd,
+    uint32_t pos)
+{
+    if (int32_t(pos - _storedCheck) < 0) {
+        return 0;   // Checked recently
+    }
+    const int maxLen = int(std::min({ ptrdiff_t(kStoredMaxLength), inputEnd - input, outputEnd - out - kStoredOverhead }));
+    if (maxLen < kStoredMinLength) {
+        return 0;   // Check again with more input or output space
+    }
+    // A block is worth storing if the escapes cost more than its overhead. Escapes between
+    // short runs of text may not be worth a block each, but still expand the data: fold the
+    // text into one block. Otherwise end the block where text starts: the tables compress
+    // text better than the estimate, which doesn't know them. The input starts with an
+    // escape, so neither block is empty.
+    const int folded = blockLength(input, maxLen, kStoredTextRun);
+    int len = folded;
+    if (estimateSize(input, len, _format & ~kFormatStored) <= size_t(len + kStoredOverhead)) {
+        len = blockLength(input, folded, kStoredPlainRun);
+        if (len < kStoredMinLength
+            || estimateSize(input, len, _format & ~kFormatStored) <= size_t(len + kStoredOverhead)) {
+            // Worth encoding. Don't estimate again for these bytes.
+            _storedCheck = pos + folded;
+            return 0;
+        }
+    }
+    *out++ = kLiteral;
+    *out++ = kStoredToken;
+    *out++ = static_cast<uint8_t>(len);
+    memcpy(out, input, len);
+    return len;
+}
+
 // Take ABCD
 // BC = 1 already in table
 // compress:
@@ -128,6 +358,99 @@ int Compressor::writeRLE(const uint8_t* input, const uint8_t* inputEnd, uint8_t*
 //   *in = D. next= ? done
 
 
+bool Compressor::splitsLine(const uint8_t* tokenStart, const uint8_t* lineEnd, const uint8_t* inputEnd) const
+{
+    const uint8_t* next = lineEnd + 1;
+    const uint8_t* eol = static_cast<const uint8_t*>(memchr(next, '\n', inputEnd - next));
+    const uint8_t* end = eol ? eol + 1 : inputEnd;
+    return _state->history.mayRepeat(tokenStart, int(next - tokenStart), next, int(end - next));
+}
+
+void Compressor::releaseMatch()
+{
+    if (_matchLen == 0) {
+        return;
+    }
+    // The held bytes are the start of any of the lines they matched.
+    int ref = 0;
+    while (!(_matchRefs & (1 << ref))) {
+        ref++;
+    }
+    int len = 0;
+    _state->history.get(ref, _pendingPos, len);
+    _pendingLen = _matchLen;
+    _matchRefs = 0;
+    _matchLen = 0;
+}
+
+int Compressor::matchLine(const uint8_t* input, const uint8_t* inputEnd, uint8_t* out, const uint8_t* outputEnd)
+{
+    // Compare up to the end of the line, or of the input
+    const uint8_t* eol = static_cast<const uint8_t*>(memchr(input, '\n', inputEnd - input));
+    const uint8_t* end = eol ? eol + 1 : inputEnd;
+    const int refs = _state->history.match(_matchLen > 0 ? _matchRefs : kLineAllRefs, _matchLen,
+        input, int(end - input));
+
+    if (refs == 0) {
+        releaseMatch();
+        return 0;
+    }
+    if (!eol) {
+        // Could still be a repeat: hold it.
+        _matchRefs = refs;
+        _matchLen += int(end - input);
+        return int(end - input);
+    }
+
+    // A repeat of the most recent of the lines
+    if (out + 2 > outputEnd) {
+        return -1;
+    }
+    int ref = 0;
+    while (!(refs & (1 << ref))) {
+        ref++;
+    }
+    *out++ = kLiteral;
+    *out++ = static_cast<uint8_t>(kLineRefStart + ref);
+    _state->history.appendLine(ref);
+    _matchRefs = 0;
+    _matchLen = 0;
+    return int(end - input);
+}
+
+int Compressor::writePending(const uint8_t* input, const uint8_t* inputEnd, uint8_t*& out, const uint8_t* outputEnd,
+    uint32_t pos)
+{
+    int used = 0;
+    while (_pendingLen > 0 && out < outputEnd) {
+        // A piece of the held bytes, and what follows them: more of them, or the input
+        uint8_t buf[kPendingPiece + kPendingLookahead];
+        const int n = std::min(_pendingLen, kPendingPiece);
+        int size = std::min(_pendingLen, int(sizeof(buf)));
+        _state->history.read(_pendingPos, buf, size);
+        if (size == _pendingLen && input < inputEnd) {
+            const int extra = int(std::min(sizeof(buf) - size, size_t(inputEnd - input)));
+            memcpy(buf + size, input, extra);
+            size += extra;
+        }
+
+        const int done = int(encode(buf, buf + n, buf + size, out, outputEnd, pos - _pendingLen, false) - buf);
+        if (done == 0) {
+            break;
+        }
+        if (done >= _pendingLen) {
+            // The last token ran into the input
+            used = done - _pendingLen;
+            _pendingLen = 0;
+        }
+        else {
+            _pendingPos += done;
+            _pendingLen -= done;
+        }
+    }
+    return used;
+}
+
 Result Compressor::compress(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize)
 {
     const uint8_t* in = input;
@@ -135,7 +458,84 @@ Result Compressor::compress(const uint8_t* input, size_t inputSize, uint8_t* out
     uint8_t* out = output;
     const uint8_t* outEnd = output + outputSize;
 
-    while (in < inEnd && out < outEnd) {
+    if ((_format & kFormatNeedsState) && !_state) {
+        return Result{ 0, 0, false, true };
+    }
+
+    // Finish a held line that turned out not to be a repeat
+    if (_pendingLen > 0) {
+        in += writePending(in, inEnd, out, outEnd, _pos);
+    }
+    if (_pendingLen == 0) {
+        in = encode(in, inEnd, inEnd, out, outEnd, _pos + uint32_t(in - input), true);
+    }
+    _pos += uint32_t(in - input);
+    return Result{
+        static_cast<int>(in - input),
+        static_cast<int>(out - output),
+        false
+    };
+}
+
+Result Compressor::flush(uint8_t* output, size_t outputSize)
+{
+    uint8_t* out = output;
+    if ((_format & kFormatNeedsState) && !_state) {
+        return Result{ 0, 0, false, true };
+    }
+    // A line that ends with the stream isn't a repeat.
+    releaseMatch();
+    if (_pendingLen > 0) {
+        writePending(nullptr, nullptr, out, output + outputSize, _pos);
+    }
+    return Result{ 0, static_cast<int>(out - output), false };
+}
+
+const uint8_t* Compressor::encode(const uint8_t* input, const uint8_t* stop, const uint8_t* inEnd,
+    uint8_t*& out, const uint8_t* outEnd, uint32_t pos, bool lineRefs)
+{
+    const uint8_t* in = input;
+    const uint8_t* historyMark = input;   // Input not yet appended to the history
+    const uint8_t* notRepeat = nullptr;   // Line start that was checked, and isn't a repeat
+    lineRefs = lineRefs && (_format & kFormatLineRef);
+
+    while (in < stop && out < outEnd) {
+        // At the start of a line, or in a line held back, check for a repeat of a recent line.
+        if (lineRefs && in != notRepeat
+            && (_matchLen > 0 || (in > input ? in[-1] == '\n' : _state->history.atLineStart()))) {
+            if (_matchLen == 0) {
+                _state->history.append(historyMark, in - historyMark);
+                historyMark = in;
+            }
+            const int lineBytes = matchLine(in, inEnd, out, outEnd);
+            if (lineBytes < 0) {
+                break;
+            }
+            if (lineBytes > 0) {
+                in += lineBytes;
+                if (_matchLen == 0) {
+                    // A reference, which is not pushed to the Table
+                    out += 2;
+                    historyMark = in;
+                    if (_format & kFormatLongTable) {
+                        _state->longTable.breakSequence();
+                    }
+                }
+                continue;
+            }
+            notRepeat = in;
+            if (_pendingLen > 0) {
+                // Held bytes from previous calls go first. They include everything
+                // since historyMark, and maybe some of the input.
+                in += writePending(in, inEnd, out, outEnd, pos + uint32_t(in - input));
+                historyMark = in;
+                if (_pendingLen > 0) {
+                    break;
+                }
+                continue;
+            }
+        }
+
         // Try RLE encoding first. There are some log files with a 
         // lot of space runs, dashes, 0 leads on numbers, where
 		// this is a significant win.
@@ -144,15 +544,48 @@ Result Compressor::compress(const uint8_t* input, size_t inputSize, uint8_t* out
             // RLE succeeded and already wrote 2 bytes
             in += rleBytes;
             out += 2;
+            if (_format & kFormatLongTable) {
+                _state->longTable.breakSequence();
+            }
             continue;
         }
 
         const uint8_t byte = *in;
         const uint8_t nextByte = (in + 1 < inEnd) ? *(in + 1) : 0;
 
+        // With line references, a token can run past the end of a line unless the next
+        // line could be a repeat. The history needs the line up to the token for that.
+        if (lineRefs) {
+            _state->history.append(historyMark, in - historyMark);
+            historyMark = in;
+        }
+        const bool splitLine = lineRefs && byte == '\n' && in + 1 < inEnd && splitsLine(in, in, inEnd);
+
+        // Longer sequences first. Entries are always ASCII, so a match implies it.
+        if (_format & kFormatLongTable) {
+            const int idx = _state->longTable.fetch(in, int(inEnd - in));
+            uint8_t seq[kLongMaxLength];
+            const int len = idx >= 0 ? _state->longTable.get(idx, seq) : 0;
+            const uint8_t* lineEnd = idx >= 0 && (_format & kFormatLineRef)
+                ? static_cast<const uint8_t*>(memchr(in, '\n', len - 1)) : nullptr;
+            // Without lineRefs, as for held bytes, there's no line start in the token.
+            if (idx >= 0 && !(lineEnd && (!lineRefs || splitsLine(in, lineEnd, inEnd)))) {
+                if (out + 1 > outEnd) {
+                    break;
+                }
+                *out++ = static_cast<uint8_t>(idx + kLongTableStart);
+                in += len;
+                for (int i = 0; i < len; i++) {
+                    _table.push(seq[i]);
+                }
+                _state->longTable.push(seq, len);
+                continue;
+            }
+        }
+
         // If both ASCII, check if we can use byte-pair compression
         // Query table before pushing to match decompressor behavior
-        if (isAscii(byte) && isAscii(nextByte)) {
+        if (isPlain(byte, _format) && isPlain(nextByte, _format) && !splitLine) {
             const int idx = _table.fetch(byte, nextByte);
             if (idx >= 0) {
                 if (out + 1 > outEnd) {
@@ -162,18 +595,37 @@ Result Compressor::compress(const uint8_t* input, size_t inputSize, uint8_t* out
                 in += 2;
                 _table.push(byte);
                 _table.push(nextByte);
+                if (_format & kFormatLongTable) {
+                    _state->longTable.push(in - 2, 2);
+                }
                 continue;
             }
         }
 
         // Emit as literal
-        if (!isAscii(byte)) {
+        if (!isPlain(byte, _format)) {
+            // Binary data escapes most bytes, and may be better stored
+            if (_format & kFormatStored) {
+                const int storedBytes = writeStored(in, inEnd, out, outEnd, pos + uint32_t(in - input));
+                if (storedBytes > 0) {
+                    // Stored blocks are not pushed to the Table
+                    in += storedBytes;
+                    out += storedBytes + kStoredOverhead;
+                    if (_format & kFormatLongTable) {
+                        _state->longTable.breakSequence();
+                    }
+                    continue;
+                }
+            }
             // High-bit values need escape sequence: kLiteral marker + value
             if (out + 2 > outEnd) {
                 break;
             }
             *out++ = kLiteral;
             *out++ = *in++;
+            if (_format & kFormatLongTable) {
+                _state->longTable.breakSequence();
+            }
         }
         else {
             // Low ASCII values can be written directly
@@ -181,15 +633,27 @@ Result Compressor::compress(const uint8_t* input, size_t inputSize, uint8_t* out
                 break;
             }
             _table.push(byte);
+            if (_format & kFormatLongTable) {
+                _state->longTable.push(in, 1);
+            }
             *out++ = *in++;
         }
     }
-    Result result{
-        static_cast<int>(in - input),
-        static_cast<int>(out - output),
-        false
-    };
-    return result;
+    // Bytes held back aren't in the history until they are written.
+    if ((_format & kFormatLineRef) && _matchLen == 0) {
+        _state->history.append(historyMark, in - historyMark);
+    }
+    return in;
+}
+
+Decompressor::Decompressor(bool eofFF, uint32_t format, FormatState* state)
+    : _detectEOF(eofFF),
+    _format(format),
+    _state(state)
+{
+    if (_state) {
+        *_state = FormatState();
+    }
 }
 
 Result Decompressor::decompress(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize)
@@ -198,15 +662,53 @@ Result Decompressor::decompress(const uint8_t* input, size_t inputSize, uint8_t*
     const uint8_t* inEnd = input + inputSize;
     uint8_t* out = output;
     const uint8_t* outEnd = output + outputSize;
+    const uint8_t* historyMark = output;  // Output not yet appended to the history
     bool eofFF = false;
+    bool error = false;
+
+    if ((_format & kFormatNeedsState) && !_state) {
+        return Result{ 0, 0, false, true };
+    }
+
+    while (_copyLen > 0 && out < outEnd) {
+        // Finish a line reference from the previous call
+        const int n = std::min(_copyLen, int(outEnd - out));
+        _state->history.read(_copyPos, out, n);
+        out += n;
+        _copyPos += n;
+        _copyLen -= n;
+    }
+    if (_copyLen == 0 && _copySkip > 0) {
+        // Now the reference at the start of the input is done.
+        const int n = std::min(_copySkip, int(inEnd - in));
+        in += n;
+        _copySkip -= n;
+    }
 
     while(in < inEnd && out < outEnd) {
+        if (_storedHeader) {
+            _storedLen = *in++;
+            _storedHeader = false;
+            continue;
+        }
+        if (_storedLen > 0) {
+            // Stored bytes are copied as-is, and aren't checked for EOF
+            const int n = std::min({ _storedLen, int(inEnd - in), int(outEnd - out) });
+            memcpy(out, in, n);
+            in += n;
+            out += n;
+            _storedLen -= n;
+            continue;
+        }
+
         uint8_t byte = *in;
+        bool carried = false;
 
         if (_carry >= 0) {
             byte = uint8_t(_carry);
             in--;
             _carry = -1;
+            carried = true;
         }
 
         if (_detectEOF && (byte == 0xff)) {
@@ -218,9 +720,10 @@ Result Decompressor::decompress(const uint8_t* input, size_t inputSize, uint8_t*
             int nRLE = static_cast<int>(byte - kRLEStart + kRLEMinLength);
 
             static constexpr int kInReq = 2;
-            int kOutReq = 1 + nRLE;
+            const int kOutReq = nRLE;
 			if (in + kInReq > inEnd || out + kOutReq > outEnd) {
-                if (in + 1 == inEnd) {
+                // Keep a carried marker too, rather than hand back a byte from the previous input.
+                if (in + 1 == inEnd || carried) {
 					_carry = byte;
                     ++in;
                     break;
@@ -234,6 +737,27 @@ Result Decompressor::decompress(const uint8_t* input, size_t inputSize, uint8_t*
             for (int i = 0; i < nRLE; i++) {
                 *out++ = value;
 			}
+            if (_format & kFormatLongTable) {
+                _state->longTable.breakSequence();
+            }
+            continue;
+        }
+        else if ((_format & kFormatLongTable) && byte >= kLongTableStart && byte <= kLongTableEnd) {
+            uint8_t seq[kLongMaxLength];
+            const int len = _state->longTable.get(byte - kLongTableStart, seq);
+            if (len == 0) {
+                error = true;   // The entry hasn't been filled in yet
+                break;
+            }
+            if (out + len > outEnd) {
+                break; // Not enough output space
+            }
+            for (int i = 0; i < len; i++) {
+                _table.push(seq[i]);
+                *out++ = seq[i];
+            }
+            _state->longTable.push(seq, len);
+            in++;
             continue;
         }
         else if (byte >= kTableStart && byte <= kTableEnd) {
@@ -247,6 +771,10 @@ Result Decompressor::decompress(const uint8_t* input, size_t inputSize, uint8_t*
             _table.get(byte - kTableStart, a, b);
             _table.push(a);
             _table.push(b);
+            if (_format & kFormatLongTable) {
+                const uint8_t pair[2] = { a, b };
+                _state->longTable.push(pair, 2);
+            }
             in++;
             *out++ = a;
             *out++ = b;
@@ -264,20 +792,270 @@ Result Decompressor::decompress(const uint8_t* input, size_t inputSize, uint8_t*
                 break; // Not enough input or output space
             }
             ++in;   // consume marker
+            if ((_format & kFormatStored) && *in == kStoredToken) {
+                // Stored block: the length and bytes follow, maybe in later calls.
+                in++;
+                _storedHeader = true;
+                if (_format & kFormatLongTable) {
+                    _state->longTable.breakSequence();
+                }
+                continue;
+            }
+            if ((_format & kFormatLineRef) && *in >= kLineRefStart && *in <= kLineRefEnd) {
+                // Line reference: everything before it must be in the history.
+                _state->history.append(historyMark, out - historyMark);
+                historyMark = out;
+                uint32_t pos = 0;
+                int len = 0;
+                if (!_state->history.get(*in - kLineRefStart, pos, len)) {
+                    // Not a recent line. Stop before the reference.
+                    error = true;
+                    if (carried) {
+                        _carry = kLiteral;
+                    }
+                    else {
+                        in--;
+                    }
+                    break;
+                }
+                in++;
+                const int n = std::min(len, int(outEnd - out));
+                _state->history.read(pos, out, n);
+                out += n;
+                _copyPos = pos + n;
+                _copyLen = len - n;
+                if (_format & kFormatLongTable) {
+                    _state->longTable.breakSequence();
+                }
+                if (_copyLen > 0) {
+                    // The output is full. The reference is consumed when the rest is
+                    // copied, so a caller that stops when the input runs out calls again.
+                    const uint8_t* tokenStart = carried ? input : in - 2;
+                    _copySkip = int(in - tokenStart);
+                    in = tokenStart;
+                    break;
+                }
+                continue;
+            }
 			*out++ = *in++;
+            if (_format & kFormatLongTable) {
+                _state->longTable.breakSequence();
+            }
             continue;
         }
         else {
             _table.push(byte);
+            if (_format & kFormatLongTable) {
+                _state->longTable.push(&byte, 1);
+            }
             *out++ = byte;
 			in++;
         }
     }
+    if (_format & kFormatLineRef) {
+        _state->history.append(historyMark, out - historyMark);
+    }
     return Result{
         static_cast<int>(in - input),
         static_cast<int>(out - output),
-        eofFF
+        eofFF,
+        error
     };
 }
 
+namespace {
+
+// Cost model for estimates: escapes, runs, and pairs that repeat. The pairs are kept
+// in a direct mapped table, a rough stand in for Table at a fraction of the cost.
+class CostModel {
+public:
+    CostModel(uint32_t format) : _format(format) {}
+
+    // Estimated compressed size of data
+    size_t cost(const uint8_t* data, size_t size);
+
+private:
+    struct Entry {
+        uint16_t pair = 0;  // a << 8 | b, 0 if empty
+        bool hit = false;
+    };
+
+    uint32_t _format;
+    std::array<Entry, kTableSize> _pairs;
+};
+
+size_t CostModel::cost(const uint8_t* data, size_t size)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    size_t cost = 0;
+    while (p < end) {
+        const uint8_t byte = *p;
+        const uint8_t* run = p + 1;
+        while (run < end && *run == byte && run - p < kRLEMaxLength) {
+            run++;
+        }
+        if (run - p >= kRLEMinLength) {
+            cost += 2;
+            p = run;
+            continue;
+        }
+        if (!isPlain(byte, _format)) {
+            cost += 2;
+            p++;
+            continue;
+        }
+        cost++;
+        if (p + 1 < end && isPlain(p[1], _format)) {
+            const uint16_t pair = uint16_t(byte << 8 | p[1]);
+            Entry& entry = _pairs[pair % kTableSize];
+            if (entry.pair == pair) {
+                entry.hit = true;
+                p += 2;
+                continue;
+            }
+            // A pair that was used gets a second chance, like Table's counts.
+            if (entry.hit) {
+                entry.hit = false;
+            }
+            else {
+                entry.pair = pair;
+            }
+        }
+        p++;
+    }
+    if (_format & kFormatStored) {
+        cost = std::min(cost, size + kStoredOverhead * ((size + kStoredMaxLength - 1) / kStoredMaxLength));
+    }
+    return cost;
+}
+
+} // namespace
+
+size_t estimateSize(const uint8_t* data, size_t size, uint32_t format)
+{
+    CostModel model(format);
+    size_t cost = 0;
+    for (size_t pos = 0; pos < size; pos += kEstimateWindow) {
+        cost += model.cost(data + pos, std::min(size - pos, size_t(kEstimateWindow)));
+    }
+    return cost;
+}
+
+float estimateRatio(const uint8_t* data, size_t size, uint32_t format)
+{
+    if (size == 0) {
+        return 1.0f;
+    }
+    if (size <= size_t(kEstimateWindow) * kEstimateSamples) {
+        return float(estimateSize(data, size, format)) / size;
+    }
+    // Windows spread evenly from the start to the end
+    CostModel model(format);
+    const size_t step = (size - kEstimateWindow) / (kEstimateSamples - 1);
+    size_t cost = 0;
+    for (int i = 0; i < kEstimateSamples; i++) {
+        cost += model.cost(data + i * step, kEstimateWindow);
+    }
+    return float(cost) / (size_t(kEstimateWindow) * kEstimateSamples);
+}
+
+uint8_t* SinkWriter::reserve(size_t& size)
+{
+    if (_sink.acquire) {
+        uint8_t* space = _sink.acquire(_sink.user, kStreamMinOutput, &size);
+        return (space && size >= size_t(kStreamMinOutput)) ? space : nullptr;
+    }
+    size = _buffer.size() - _bufferSize;
+    return _buffer.data() + _bufferSize;
+}
+
+bool SinkWriter::commit(size_t n)
+{
+    if (_sink.acquire) {
+        _sink.commit(_sink.user, n);
+        return true;
+    }
+    _bufferSize += int(n);
+    if (_buffer.size() - _bufferSize < size_t(kStreamMinOutput)) {
+        return flush();
+    }
+    return true;
+}
+
+bool SinkWriter::flush()
+{
+    if (_sink.acquire || _bufferSize == 0) {
+        return true;
+    }
+    const bool ok = _sink.write(_sink.user, _buffer.data(), _bufferSize);
+    _bufferSize = 0;
+    return ok;
+}
+
+bool StreamCompressor::write(const uint8_t* data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        size_t space = 0;
+        uint8_t* out = _writer.reserve(space);
+        if (!out) {
+            return false;
+        }
+        Result r = _compressor.compress(data + pos, size - pos, out, space);
+        if (r.error) {
+            return false;
+        }
+        pos += r.nInput;
+        if (!_writer.commit(r.nOutput)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool StreamCompressor::flush()
+{
+    for (;;) {
+        size_t space = 0;
+        uint8_t* out = _writer.reserve(space);
+        if (!out) {
+            return false;
+        }
+        Result r = _compressor.flush(out, space);
+        if (r.error || !_writer.commit(r.nOutput)) {
+            return false;
+        }
+        if (r.nOutput == 0) {
+            return _writer.flush();
+        }
+    }
+}
+
+bool StreamDecompressor::write(const uint8_t* data, size_t size)
+{
+    size_t pos = 0;
+    while (!_eof) {
+        size_t space = 0;
+        uint8_t* out = _writer.reserve(space);
+        if (!out) {
+            return false;
+        }
+        Result r = _decompressor.decompress(data + pos, size - pos, out, space);
+        pos += r.nInput;
+        if (!_writer.commit(r.nOutput)) {
+            return false;
+        }
+        _eof = r.eofFF;
+        if (r.error) {
+            return false;
+        }
+        // Output that didn't fill the space means nothing is pending.
+        if (pos == size && size_t(r.nOutput) < space) {
+            break;
+        }
+    }
+    return true;
+}
+
 } // namespace mccomp
\ No newline at end of file
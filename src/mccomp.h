@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <array>
+#include <cstring>
 
 // mccomp: A streaming compression algorithm optimized for microcontrollers and embedded systems.
 // Uses RLE (Run-Length Encoding) and a dynamically built byte-pair lookup table.
@@ -25,12 +27,63 @@ static constexpr int kRLEMinLength = 3;
 static constexpr int kRLEMaxLength = kRLEEnd - kRLEStart + kRLEMinLength - 1;
 static constexpr int kTableSize = kTableEnd - kTableStart + 1;
 
+// Optional format extensions, OR'd together. Like the tables, the format is not stored
+// in the compressed stream: the Compressor and Decompressor must use the same flags.
+static constexpr uint32_t kFormatBase = 0;
+static constexpr uint32_t kFormatLongTable = 1 << 0;   // Second table of 3-4 byte sequences
+static constexpr uint32_t kFormatLineRef = 1 << 1;     // Reference tokens for repeated lines
+static constexpr uint32_t kFormatStored = 1 << 2;      // Stored blocks for data that doesn't compress
+
+// Long table range: with kFormatLongTable, the rarely used control bytes after \r map
+// to 3-4 byte sequences. Input bytes in this range are then escaped with kLiteral.
+static constexpr uint8_t kLongTableStart = 14;
+static constexpr uint8_t kLongTableEnd = 31;
+static constexpr int kLongTableSize = kLongTableEnd - kLongTableStart + 1;
+static constexpr int kLongMinLength = 3;
+static constexpr int kLongMaxLength = 4;
+
+// Extension tokens: kLiteral is only ever followed by a byte that needs escaping, so
+// kLiteral followed by a printable byte is free for format extensions.
+static constexpr uint8_t kExtStart = 32;
+
+// Line references: with kFormatLineRef, kLiteral followed by a byte in the range of
+// [kLineRefStart, kLineRefEnd] repeats one of the last kLineSlots lines.
+static constexpr int kLineSlots = 8;
+static constexpr int kLineHistorySize = 512;    // Bytes of recent output kept, power of 2
+static constexpr int kLineMinLength = 4;        // Shorter lines aren't worth a reference
+static constexpr uint8_t kLineRefStart = kExtStart;
+static constexpr uint8_t kLineRefEnd = kLineRefStart + kLineSlots - 1;
+static constexpr int kLineAllRefs = (1 << kLineSlots) - 1;    // Bit i is the line of ref i
+
+// Most bytes that compressed data can decode to, per compressed byte: a 2 byte line
+// reference can repeat a line as long as the history. Bounds sizes read from headers.
+static constexpr int kMaxExpansion = kLineHistorySize / 2;
+
+// Stored blocks: with kFormatStored, kLiteral followed by kStoredToken and a length
+// byte is followed by that many bytes as-is. Used where escaping would cost more.
+static constexpr uint8_t kStoredToken = kLineRefEnd + 1;
+static constexpr int kStoredOverhead = 3;
+static constexpr int kStoredMinLength = kStoredOverhead + 1;   // Shorter blocks can't save the overhead
+static constexpr int kStoredPlainRun = 8;       // Plain bytes in a row that end a block
+static constexpr int kStoredTextRun = 32;       // Or a block too short to store, with shorter runs folded in
+static constexpr int kStoredMaxLength = 254;      // The length is never 0xff, the EOF on flash
+
+// Compressibility estimates sample up to kEstimateSamples windows of kEstimateWindow bytes.
+static constexpr int kEstimateWindow = 1024;
+static constexpr int kEstimateSamples = 8;
+
 // Check if a byte falls in the regular ASCII range.
 // These bytes can be passed through without encoding/escaping.
 inline bool isAscii(uint8_t byte) {
     return byte > kRLEEnd && byte < kLiteral;
 }
 
+// Check if a byte can be written as-is with the given format flags.
+inline bool isPlain(uint8_t byte, uint32_t format) {
+    return isAscii(byte)
+        && !((format & kFormatLongTable) && byte >= kLongTableStart && byte <= kLongTableEnd);
+}
+
 // Adaptive byte-pair lookup table.
 // Both compressor and decompressor build this table identically as they process the stream,
 // allowing the decompressor to decode without needing the table transmitted.
@@ -83,18 +136,135 @@ private:
     std::array<Entry, kTableSize> _table;  // The hash table
 };
 
+// Adaptive table of 3-4 byte sequences (kFormatLongTable).
+// Sequences are promoted from adjacent tokens that include a byte pair: pair + byte,
+// byte + pair, or pair + pair. Like Table, both sides push the same tokens in the same
+// order, so the table is never transmitted.
+class LongTable {
+public:
+    // Add an emitted token (1 to kLongMaxLength ASCII bytes) to the sequence statistics
+    void push(const uint8_t* seq, int len);
+
+    // The next token does not follow the previous one (RLE or escaped literal in between)
+    void breakSequence() { _prevLen = 0; }
+
+    // Find the longest entry that is a prefix of seq, returns index or -1 if not found
+    int fetch(const uint8_t* seq, int len) const;
+
+    // Retrieve the sequence stored at a given table index, returns its length
+    int get(int idx, uint8_t* seq) const;
+
+    // Get table statistics: number of used entries and total hit count
+    void utilization(int& nUsed, int& nTotal) const;
+
+private:
+    static constexpr int kAgeRate = 8;      // Age one entry every kAgeRate pushes
+
+    static int hash(const uint8_t* seq, int len) {
+        uint32_t h = len;
+        for (int i = 0; i < len; i++) {
+            h = h * 31 + seq[i];
+        }
+        return int(h % kLongTableSize);
+    }
+
+    struct Entry {
+        uint8_t seq[kLongMaxLength] = {};
+        uint8_t len = 0;
+        uint16_t count = 0;
+
+        bool match(const uint8_t* seq_, int len_) const {
+            return len == len_ && memcmp(seq, seq_, len) == 0;
+        }
+    };
+
+    uint8_t _prev[2] = {};  // Previous token, if it could start a sequence
+    int _prevLen = 0;
+    int _count = 0;
+    std::array<Entry, kLongTableSize> _table;
+};
+
+// Recent lines of the uncompressed stream (kFormatLineRef).
+// Both sides append the same uncompressed bytes, so a line can be referenced by
+// how recent it is. Lines include the trailing '\n'.
+class LineHistory {
+public:
+    // Append uncompressed bytes. Each '\n' completes a line.
+    void append(const uint8_t* data, size_t size);
+
+    // True if the next byte appended will start a new line
+    bool atLineStart() const { return _head == _lineStart; }
+
+    // Of the recent lines in refs (bit i for ref i, where 0 is the most recent line),
+    // the ones that continue with [data, data+len) at offset. With data up to its
+    // first '\n', a line that matches is a repeat when data ends with the '\n'.
+    int match(int refs, int offset, const uint8_t* data, int len) const;
+
+    // True if a line that starts with [next, next+len) could repeat a recent line,
+    // including the line in progress once [tail, tail+tailLen) completes it.
+    bool mayRepeat(const uint8_t* tail, int tailLen, const uint8_t* next, int len) const;
+
+    // Append a copy of a recent line, which a line reference repeats
+    void appendLine(int ref);
+
+    // Position and length of a recent line, for read(). Returns false if ref is not valid.
+    bool get(int ref, uint32_t& pos, int& len) const;
+
+    // Copy n bytes starting at pos. Bytes remain readable until kLineHistorySize
+    // more bytes have been appended.
+    void read(uint32_t pos, uint8_t* out, int n) const;
+
+private:
+    struct Line {
+        uint32_t pos = 0;     // Stream position of the first byte
+        int len = 0;
+    };
+
+    bool valid(const Line& line) const {
+        return line.len > 0 && _head - line.pos <= uint32_t(kLineHistorySize);
+    }
+
+    uint32_t _head = 0;         // Total bytes appended
+    uint32_t _lineStart = 0;    // Position of the line in progress
+    int _newest = 0;            // Slot of the most recent line
+    std::array<Line, kLineSlots> _lines;
+    std::array<uint8_t, kLineHistorySize> _buf;
+};
+
+// Extensions that keep state in a FormatState
+static constexpr uint32_t kFormatNeedsState = kFormatLongTable | kFormatLineRef;
+
+// State of the kFormatLongTable and kFormatLineRef extensions, about 800 bytes.
+// The base format doesn't need it, so the caller provides it: one for each
+// Compressor or Decompressor that uses either flag.
+struct FormatState {
+    LongTable longTable;    // Adaptive 3-4 byte sequence table (kFormatLongTable)
+    LineHistory history;    // Recent lines (kFormatLineRef)
+};
+
 // Result of a compression or decompression operation.
 // Since operations are streaming, not all input may be consumed in one call.
 struct Result {
     int nInput = 0;   // Number of input bytes consumed
     int nOutput = 0;  // Number of output bytes produced
     bool eofFF = false; // If detecting 0xff as EOF, true if the EOF byte was read
+    bool error = false; // The input isn't valid, or the FormatState is missing.
+                        // Decoding stopped before the bad token.
 };
 
 // Streaming compressor using RLE and adaptive byte-pair encoding.
 // The same Compressor instance should be used for an entire stream to maintain table state.
 class Compressor {
 public:
+    // Construct a compressor.
+    //
+    // Parameters:
+    //   format - kFormatBase, or kFormat* extension flags. The Decompressor must match.
+    //   state  - Required with kFormatLongTable or kFormatLineRef, otherwise unused:
+    //            without it, compress() only returns an error. It is reset here,
+    //            and must outlive the Compressor.
+    Compressor(uint32_t format = kFormatBase, FormatState* state = nullptr);
+
 	// Compress a chunk of data. Can be called multiple times for streaming compression.
     // 
     // Parameters:
@@ -106,13 +276,66 @@ public:
     // Returns:
     //   Result with nInput bytes consumed and nOutput bytes produced.
     //   Call again with remaining data if r.nInput < inputSize.
+    //   error is set, and nothing is consumed, if the FormatState is missing.
+    //   With kFormatLineRef, the start of a line may be consumed before it is written,
+    //   while it could still repeat a recent line: call flush() at the end.
     Result compress(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize);
 
+    // Write out input that was consumed but not written (kFormatLineRef). Call at the
+    // end of the stream until nOutput is 0. Nothing is held in the base format.
+    Result flush(uint8_t* output, size_t outputSize);
+
 private:
+    // Bytes of a held line that didn't repeat are encoded in pieces of this size, with
+    // enough lookahead for any token that starts in the piece (kFormatLineRef).
+    static constexpr int kPendingPiece = 64;
+    static constexpr int kPendingLookahead = 16;
+
+    // Encode the tokens that start in [input, stop). Tokens can look ahead to inputEnd.
+    // pos is the stream position of input. Returns the end of the input used. With
+    // lineRefs, repeated lines become references.
+    const uint8_t* encode(const uint8_t* input, const uint8_t* stop, const uint8_t* inputEnd,
+        uint8_t*& out, const uint8_t* outputEnd, uint32_t pos, bool lineRefs);
+
     // Encode a run of repeated bytes using RLE markers
     int writeRLE(const uint8_t* input, const uint8_t* inputEnd, uint8_t* output, const uint8_t* outputEnd);
 
-   Table _table;  // Adaptive byte-pair lookup table
+    // True if a token can't include the '\n' at lineEnd, because the line after it could
+    // be a repeat and the reference has to start there (kFormatLineRef).
+    bool splitsLine(const uint8_t* tokenStart, const uint8_t* lineEnd, const uint8_t* inputEnd) const;
+
+    // Compare the line at input with the recent lines, holding it back while it could be
+    // a repeat, and write the reference when it is (kFormatLineRef). Returns the bytes
+    // consumed, 0 if the line isn't a repeat, or -1 if the reference doesn't fit.
+    int matchLine(const uint8_t* input, const uint8_t* inputEnd, uint8_t* output, const uint8_t* outputEnd);
+
+    // The held line isn't a repeat: its bytes become pending, to be encoded.
+    void releaseMatch();
+
+    // Encode held bytes of a line that isn't a repeat, from the history, looking ahead
+    // into input after the last of them. pos is the stream position of input. Returns
+    // the bytes of input used too.
+    int writePending(const uint8_t* input, const uint8_t* inputEnd, uint8_t*& out, const uint8_t* outputEnd,
+        uint32_t pos);
+
+    // Length of a stored block at input, up to maxLen, that ends before plainRun plain
+    // bytes in a row and doesn't end with plain bytes (kFormatStored)
+    int blockLength(const uint8_t* input, int maxLen, int plainRun) const;
+
+    // Store the data at input as-is, if it would cost more to encode (kFormatStored).
+    // pos is the stream position of input.
+    int writeStored(const uint8_t* input, const uint8_t* inputEnd, uint8_t* output, const uint8_t* outputEnd,
+        uint32_t pos);
+
+    uint32_t _format = kFormatBase;
+    Table _table;           // Adaptive byte-pair lookup table
+    FormatState* _state = nullptr;  // Extension tables, provided by the caller
+    uint32_t _pos = 0;          // Input consumed by previous calls
+    uint32_t _storedCheck = 0;  // Stored blocks aren't considered again before this position
+    int _matchRefs = 0;         // Recent lines the line being held could repeat
+    int _matchLen = 0;          // Bytes of it consumed but not written
+    uint32_t _pendingPos = 0;   // Held bytes of a line that isn't a repeat, still to
+    int _pendingLen = 0;        // be encoded from the history
 };
 
 // Streaming decompressor for data compressed with Compressor.
@@ -125,7 +348,9 @@ public:
     //   eofFF - If the input is known to be ASCII or UTF-8, then 0xff will never
     //           be written to the compressed stream and can be used as EOF.
     //           If true, will detect 0xff as EOF and set the eofFF flag in Result.
-    Decompressor(bool eofFF = false) : _detectEOF(eofFF) {}
+    //   format - kFormatBase, or the kFormat* flags the stream was compressed with.
+    //   state  - Required with kFormatLongTable or kFormatLineRef, as with Compressor.
+    Decompressor(bool eofFF = false, uint32_t format = kFormatBase, FormatState* state = nullptr);
 
 	// Decompress a chunk of data. Can be called multiple times for streaming decompression.
     // 
@@ -137,7 +362,10 @@ public:
     // 
     // Returns:
     //   Result with nInput bytes consumed and nOutput bytes produced.
-	//   Repeat calls until all data is decompressed.
+	//   Repeat calls until all data is decompressed, or until error is set: corrupt
+    //   input, or input from another format. The bad token is never consumed.
+    //   With kFormatLineRef, a line reference that doesn't fit in the output isn't
+    //   consumed until the rest of the line is written by later calls.
     Result decompress(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize);
 
     // Get statistics about table usage (for debugging and optimization)
@@ -145,11 +373,120 @@ public:
         _table.utilization(nEntries, nTotal);
     }
 
+    // Get statistics about long table usage (kFormatLongTable)
+    void longUtilization(int& nEntries, int& nTotal) const {
+        if (_state) {
+            _state->longTable.utilization(nEntries, nTotal);
+        }
+        else {
+            nEntries = nTotal = 0;
+        }
+    }
+
 private:
     bool _detectEOF = false;
+    uint32_t _format = kFormatBase;
     int _carry = -1;    // It is possible that the last byte in input is part of an escape sequence.
 	                    // In that case, we store it here to process on the next call.
     Table _table;       // Adaptive byte-pair lookup table
+    FormatState* _state = nullptr;  // Extension tables, provided by the caller
+    uint32_t _copyPos = 0;  // A line reference may not fit in the output buffer.
+    int _copyLen = 0;       // In that case, the rest is copied on the next call,
+    int _copySkip = 0;      // and then these bytes of the reference are consumed.
+    bool _storedHeader = false; // Length of a stored block is next (kFormatStored)
+    int _storedLen = 0;         // Bytes of a stored block still to copy
+};
+
+// Estimate the compressed size of data, without compressing it. Models escapes, runs,
+// and pairs that repeat. With kFormatStored, counts blocks that would be stored.
+size_t estimateSize(const uint8_t* data, size_t size, uint32_t format = kFormatBase);
+
+// Estimate the compression ratio (compressed size / size) of data from samples, so the
+// cost doesn't depend on size. Values above 1 mean the data gets larger: up to about 2
+// for binary data, or a little over 1 with kFormatStored. Text compresses better with
+// kFormatLongTable and kFormatLineRef than estimated.
+float estimateRatio(const uint8_t* data, size_t size, uint32_t format = kFormatBase);
+
+// Where StreamCompressor and StreamDecompressor put their output. Set either
+// acquire and commit, to write straight into the destination's own buffer (a page
+// cache, a socket buffer, flash), or write, to get the output in chunks from a
+// small buffer inside the stream. No memory is allocated either way.
+struct Sink {
+    // Return space for at least minSize bytes and its size in *size, or nullptr on error.
+    uint8_t* (*acquire)(void* user, size_t minSize, size_t* size) = nullptr;
+    // The first n bytes of the space from acquire() were written.
+    void (*commit)(void* user, size_t n) = nullptr;
+
+    // Write n bytes. Returns false on error.
+    bool (*write)(void* user, const uint8_t* data, size_t n) = nullptr;
+
+    void* user = nullptr;    // Passed to the callbacks
+};
+
+// Output space a stream asks for: enough for any token.
+static constexpr int kStreamMinOutput = 16;
+// Size of the stream's buffer when the Sink uses write().
+static constexpr int kStreamBufferSize = 64;
+
+// Output side of the streams: space in the Sink, or in the buffer.
+class SinkWriter {
+public:
+    SinkWriter(const Sink& sink) : _sink(sink) {}
+
+    // Space for at least kStreamMinOutput bytes, or nullptr on error
+    uint8_t* reserve(size_t& size);
+    // n bytes of the reserved space were written. Returns false on error.
+    bool commit(size_t n);
+    // Write out the buffer. Returns false on error.
+    bool flush();
+
+private:
+    Sink _sink;
+    int _bufferSize = 0;
+    std::array<uint8_t, kStreamBufferSize> _buffer;
+};
+
+// Compressor that writes to a Sink, and consumes all of its input on every call.
+class StreamCompressor {
+public:
+    // state is passed to the Compressor.
+    StreamCompressor(const Sink& sink, uint32_t format = kFormatBase, FormatState* state = nullptr)
+        : _writer(sink), _compressor(format, state) {}
+
+    // Compress all of data. Returns false if the Sink fails, or the FormatState is missing.
+    bool write(const uint8_t* data, size_t size);
+
+    // Write out the held and buffered output. Call at the end of the stream, or
+    // whenever the output should be complete so far.
+    bool flush();
+
+private:
+    SinkWriter _writer;
+    Compressor _compressor;
 };
 
-}
\ No newline at end of file
+// Decompressor that writes to a Sink, and consumes all of its input on every call.
+class StreamDecompressor {
+public:
+    // state is passed to the Decompressor.
+    StreamDecompressor(const Sink& sink, bool eofFF = false, uint32_t format = kFormatBase,
+        FormatState* state = nullptr)
+        : _writer(sink), _decompressor(eofFF, format, state) {}
+
+    // Decompress all of data, up to the 0xff EOF with eofFF. Returns false if the Sink
+    // fails, or the data isn't valid.
+    bool write(const uint8_t* data, size_t size);
+
+    // Write out the buffered output, for a Sink that uses write().
+    bool flush() { return _writer.flush(); }
+
+    // With eofFF, true once the 0xff EOF was read. Input after it is ignored.
+    bool eof() const { return _eof; }
+
+private:
+    SinkWriter _writer;
+    Decompressor _decompressor;
+    bool _eof = false;
+};
+
+}
@@ -0,0 +1,386 @@
+#include "mccomp_archive.h"
+#include "mccomp_bytes.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+namespace mccomp {
+
+namespace {
+
+int threadCount(int nThreads, size_t nJobs)
+{
+    if (nThreads <= 0) {
+        nThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    return int(std::min(size_t(nThreads), std::max(nJobs, size_t(1))));
+}
+
+// Run job(i) for every i < cost.size() on nThreads threads. The jobs are sorted
+// largest first and dealt out to a queue per thread. A thread takes from the front
+// of its own queue, and when that is empty steals from the back of another's, so
+// the big jobs start first and the small ones fill in around them.
+template<typename Job>
+void runJobs(const std::vector<size_t>& cost, int nThreads, const Job& job)
+{
+    std::vector<size_t> order(cost.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return cost[a] > cost[b]; });
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+    nThreads = threadCount(nThreads, cost.size());
+    std::vector<Queue> queues(nThreads);
+    for (size_t i = 0; i < order.size(); i++) {
+        queues[i % nThreads].jobs.push_back(order[i]);
+    }
+
+    auto worker = [&](int self) {
+        while (true) {
+            bool found = false;
+            size_t j = 0;
+            {
+                std::lock_guard<std::mutex> lock(queues[self].mutex);
+                if (!queues[self].jobs.empty()) {
+                    j = queues[self].jobs.front();
+                    queues[self].jobs.pop_front();
+                    found = true;
+                }
+            }
+            for (int k = 1; k < nThreads && !found; k++) {
+                Queue& victim = queues[(self + k) % nThreads];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.jobs.empty()) {
+                    j = victim.jobs.back();
+                    victim.jobs.pop_back();
+                    found = true;
+                }
+            }
+            // No jobs are added while running, so empty queues mean done.
+            if (!found) {
+                return;
+            }
+            job(j);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nThreads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+} // namespace
+
+void ArchiveBuilder::add(const std::string& name, const uint8_t* data, size_t size)
+{
+    assert(name.size() <= UINT16_MAX);
+    assert(size <= UINT32_MAX);
+    _inputs.push_back(Input{ name, data, size });
+}
+
+std::vector<uint8_t> ArchiveBuilder::build(int nThreads) const
+{
+    assert(_format <= UINT8_MAX);
+
+    // Split the files into segments
+    struct Job {
+        const uint8_t* data;
+        size_t size;
+    };
+    std::vector<Job> jobs;
+    std::vector<uint32_t> nSegments;
+    for (const Input& input : _inputs) {
+        size_t pos = 0;
+        uint32_t n = 0;
+        do {
+            const size_t size = std::min(input.size - pos, size_t(kArchiveSegmentSize));
+            jobs.push_back(Job{ input.data + pos, size });
+            pos += size;
+            n++;
+        } while (pos < input.size);
+        nSegments.push_back(n);
+    }
+
+    std::vector<std::vector<uint8_t>> compressed(jobs.size());
+    std::vector<size_t> cost(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        cost[i] = jobs[i].size;
+    }
+    runJobs(cost, nThreads, [&](size_t i) {
+        // Worst case, every byte is escaped
+        std::vector<uint8_t>& c = compressed[i];
+        c.resize(jobs[i].size * 2 + 16);
+        FormatState state;
+        Compressor compressor(_format, &state);
+        Result r = compressor.compress(jobs[i].data, jobs[i].size, c.data(), c.size());
+        assert(size_t(r.nInput) == jobs[i].size);
+        const size_t size = r.nOutput;
+        r = compressor.flush(c.data() + size, c.size() - size);
+        c.resize(size + r.nOutput);
+    });
+
+    std::vector<uint8_t> out;
+    out.push_back(uint8_t(_format));
+    appendU32(out, uint32_t(_inputs.size()));
+    appendU32(out, uint32_t(jobs.size()));
+    appendU32(out, 0);   // manifestSize, below
+    for (size_t m = 0; m < _inputs.size(); m++) {
+        appendU16(out, uint32_t(_inputs[m].name.size()));
+        out.insert(out.end(), _inputs[m].name.begin(), _inputs[m].name.end());
+        appendU32(out, uint32_t(_inputs[m].size));
+        appendU32(out, nSegments[m]);
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        appendU32(out, uint32_t(jobs[i].size));
+        appendU32(out, uint32_t(compressed[i].size()));
+    }
+    writeU32(out.data() + 9, uint32_t(out.size()));
+
+    size_t total = out.size();
+    for (const std::vector<uint8_t>& c : compressed) {
+        total += c.size();
+    }
+    out.reserve(total);
+    for (const std::vector<uint8_t>& c : compressed) {
+        out.insert(out.end(), c.begin(), c.end());
+    }
+    return out;
+}
+
+size_t ArchiveReader::manifestSize(const uint8_t* header, size_t size)
+{
+    if (size < size_t(kArchiveHeaderSize)) {
+        return 0;
+    }
+    const uint32_t nMembers = readU32(header + 1);
+    const uint32_t nSegments = readU32(header + 5);
+    const uint32_t manifestSize = readU32(header + 9);
+    // Every member has a name size, raw size and segment count, and every segment two sizes.
+    if (nSegments < nMembers || manifestSize < kArchiveHeaderSize + 10 * uint64_t(nMembers) + 8 * uint64_t(nSegments)) {
+        return 0;
+    }
+    return manifestSize;
+}
+
+bool ArchiveReader::readManifest(const uint8_t* data, size_t size)
+{
+    _members.clear();
+    _segments.clear();
+    const size_t manifest = manifestSize(data, size);
+    if (manifest == 0 || manifest > size) {
+        return false;
+    }
+    _format = data[0];
+    const uint32_t nMembers = readU32(data + 1);
+    const uint32_t nSegments = readU32(data + 5);
+
+    const uint8_t* p = data + kArchiveHeaderSize;
+    const uint8_t* end = data + manifest;
+    _members.resize(nMembers);
+    uint32_t segment = 0;
+    for (ArchiveMember& member : _members) {
+        if (end - p < 2) {
+            return false;
+        }
+        const uint32_t nameSize = readU16(p);
+        p += 2;
+        if (uint32_t(end - p) < nameSize + 8) {
+            return false;
+        }
+        member.name.assign(reinterpret_cast<const char*>(p), nameSize);
+        p += nameSize;
+        member.rawSize = readU32(p);
+        member.nSegments = readU32(p + 4);
+        p += 8;
+        member.firstSegment = segment;
+        if (member.nSegments == 0 || member.nSegments > nSegments - segment) {
+            return false;
+        }
+        segment += member.nSegments;
+    }
+    if (segment != nSegments || uint64_t(end - p) != 8 * uint64_t(nSegments)) {
+        return false;
+    }
+
+    _segments.resize(nSegments);
+    uint64_t offset = manifest;
+    for (Segment& s : _segments) {
+        s.rawSize = readU32(p);
+        s.compressedSize = readU32(p + 4);
+        s.offset = offset;
+        offset += s.compressedSize;
+        p += 8;
+        // The sizes are used to allocate, so check they could be real.
+        if (s.rawSize > kArchiveSegmentSize || s.rawSize > uint64_t(s.compressedSize) * kMaxExpansion) {
+            return false;
+        }
+    }
+    for (ArchiveMember& member : _members) {
+        const Segment& first = _segments[member.firstSegment];
+        const Segment& last = _segments[member.firstSegment + member.nSegments - 1];
+        member.offset = first.offset;
+        member.compressedSize = last.offset + last.compressedSize - first.offset;
+        uint64_t rawSize = 0;
+        for (uint32_t s = 0; s < member.nSegments; s++) {
+            rawSize += _segments[member.firstSegment + s].rawSize;
+        }
+        if (rawSize != member.rawSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int ArchiveReader::find(const std::string& name) const
+{
+    for (size_t i = 0; i < _members.size(); i++) {
+        if (_members[i].name == name) {
+            return int(i);
+        }
+    }
+    return -1;
+}
+
+bool ArchiveReader::extractSegment(const Segment& segment, const uint8_t* compressed, uint8_t* out) const
+{
+    FormatState state;
+    Decompressor decompressor(false, _format, &state);
+    size_t in = 0;
+    size_t produced = 0;
+    while (in < segment.compressedSize || produced < segment.rawSize) {
+        Result r = decompressor.decompress(compressed + in, segment.compressedSize - in,
+            out + produced, segment.rawSize - produced);
+        if (r.error || (r.nInput == 0 && r.nOutput == 0)) {
+            return false;
+        }
+        in += r.nInput;
+        produced += r.nOutput;
+    }
+    return true;
+}
+
+bool ArchiveReader::extract(int i, const uint8_t* compressed, std::vector<uint8_t>& out) const
+{
+    if (i < 0 || i >= count()) {
+        return false;
+    }
+    const ArchiveMember& member = _members[i];
+    out.resize(member.rawSize);
+    size_t pos = 0;
+    for (uint32_t s = 0; s < member.nSegments; s++) {
+        const Segment& segment = _segments[member.firstSegment + s];
+        if (!extractSegment(segment, compressed + (segment.offset - member.offset), out.data() + pos)) {
+            return false;
+        }
+        pos += segment.rawSize;
+    }
+    return true;
+}
+
+bool ArchiveReader::extractAll(const uint8_t* archive, size_t size, std::vector<std::vector<uint8_t>>& out,
+    int nThreads) const
+{
+    if (!_segments.empty()) {
+        const Segment& last = _segments.back();
+        if (last.offset + last.compressedSize > size) {
+            return false;
+        }
+    }
+
+    // Every segment decompresses straight into its place in its member.
+    struct Job {
+        const Segment* segment;
+        uint8_t* out;
+    };
+    std::vector<Job> jobs;
+    std::vector<size_t> cost;
+    out.resize(_members.size());
+    for (size_t m = 0; m < _members.size(); m++) {
+        const ArchiveMember& member = _members[m];
+        out[m].resize(member.rawSize);
+        size_t pos = 0;
+        for (uint32_t s = 0; s < member.nSegments; s++) {
+            const Segment& segment = _segments[member.firstSegment + s];
+            jobs.push_back(Job{ &segment, out[m].data() + pos });
+            cost.push_back(segment.rawSize);
+            pos += segment.rawSize;
+        }
+    }
+
+    std::vector<uint8_t> ok(jobs.size(), 0);
+    runJobs(cost, nThreads, [&](size_t i) {
+        ok[i] = extractSegment(*jobs[i].segment, archive + jobs[i].segment->offset, jobs[i].out);
+    });
+    return std::all_of(ok.begin(), ok.end(), [](uint8_t v) { return v != 0; });
+}
+
+namespace {
+
+bool extractFromFile(FILE* fp, const std::string& name, std::vector<uint8_t>& out)
+{
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        return false;
+    }
+    const long fileSize = ftell(fp);
+    uint8_t header[kArchiveHeaderSize];
+    if (fileSize < 0 || fseek(fp, 0, SEEK_SET) != 0
+        || fread(header, 1, kArchiveHeaderSize, fp) != size_t(kArchiveHeaderSize)) {
+        return false;
+    }
+    // Sizes from the header are checked against the file before allocating.
+    const size_t manifestSize = ArchiveReader::manifestSize(header, kArchiveHeaderSize);
+    if (manifestSize == 0 || manifestSize > size_t(fileSize)) {
+        return false;
+    }
+    std::vector<uint8_t> manifest(manifestSize);
+    memcpy(manifest.data(), header, kArchiveHeaderSize);
+    const size_t rest = manifest.size() - kArchiveHeaderSize;
+    ArchiveReader reader;
+    if (fread(manifest.data() + kArchiveHeaderSize, 1, rest, fp) != rest
+        || !reader.readManifest(manifest.data(), manifest.size())) {
+        return false;
+    }
+    const int i = reader.find(name);
+    if (i < 0) {
+        return false;
+    }
+
+    // Only this member's compressed bytes are read.
+    const ArchiveMember& member = reader.member(i);
+    if (member.offset + member.compressedSize > uint64_t(fileSize)) {
+        return false;
+    }
+    std::vector<uint8_t> compressed(member.compressedSize);
+    if (fseek(fp, long(member.offset), SEEK_SET) != 0
+        || fread(compressed.data(), 1, compressed.size(), fp) != compressed.size()) {
+        return false;
+    }
+    return reader.extract(i, compressed.data(), out);
+}
+
+} // namespace
+
+bool archiveExtractFile(const char* path, const std::string& name, std::vector<uint8_t>& out)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    const bool ok = extractFromFile(fp, name, out);
+    fclose(fp);
+    return ok;
+}
+
+} // namespace mccomp
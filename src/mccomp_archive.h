@@ -0,0 +1,102 @@
+#pragma once
+
+#include "mccomp.h"
+
+#include <string>
+#include <vector>
+
+// Archive of many files, such as a device's rotated logs, in one stream. A manifest
+// of names and sizes comes first, then the compressed files in order. Every file is
+// compressed by its own Compressor, and large files are split into segments that are
+// compressed independently, so the archive is built and extracted on all cores, and
+// one file can be extracted by reading only its own bytes.
+//
+// The builder keeps the inputs and every compressed segment in memory until the
+// archive is put together; it runs where the logs are collected, not on the device.
+namespace mccomp {
+
+static constexpr uint32_t kArchiveSegmentSize = 256 * 1024;    // Raw bytes per segment
+
+// Stream layout, integers are little endian:
+//   format          1 byte, kFormat* flags used by every Compressor
+//   nMembers        4 bytes
+//   nSegments       4 bytes
+//   manifestSize    4 bytes, size of everything before the compressed data
+//   per member:     name size (2 bytes), name, raw size (4 bytes), segments (4 bytes)
+//   per segment:    raw size (4 bytes), compressed size (4 bytes)
+// then the compressed segments in order. A member's segments are consecutive,
+// and all but its last have kArchiveSegmentSize raw bytes.
+static constexpr int kArchiveHeaderSize = 13;
+
+struct ArchiveMember {
+    std::string name;
+    uint32_t rawSize = 0;
+    uint64_t offset = 0;            // Compressed data, from the start of the archive
+    uint64_t compressedSize = 0;
+    uint32_t firstSegment = 0;
+    uint32_t nSegments = 0;
+};
+
+class ArchiveBuilder {
+public:
+    ArchiveBuilder(uint32_t format = kFormatBase) : _format(format) {}
+
+    // Add a file. The data isn't copied, and must be valid until build().
+    void add(const std::string& name, const uint8_t* data, size_t size);
+
+    // Compress all the files on nThreads threads, 0 for one per core, and return
+    // the archive. The segments are scheduled largest first on a work stealing pool.
+    std::vector<uint8_t> build(int nThreads = 0) const;
+
+private:
+    struct Input {
+        std::string name;
+        const uint8_t* data;
+        size_t size;
+    };
+    uint32_t _format = kFormatBase;
+    std::vector<Input> _inputs;
+};
+
+class ArchiveReader {
+public:
+    // Size of the manifest, from the first kArchiveHeaderSize bytes of an archive.
+    // Returns 0 if the header isn't valid.
+    static size_t manifestSize(const uint8_t* header, size_t size);
+
+    // Parse the manifest, which is the first manifestSize() bytes of the archive.
+    // Returns false if it isn't valid.
+    bool readManifest(const uint8_t* data, size_t size);
+
+    int count() const { return int(_members.size()); }
+    const ArchiveMember& member(int i) const { return _members[i]; }
+    // Index of the member with the name, or -1.
+    int find(const std::string& name) const;
+
+    // Decompress member i from its compressed data: member(i).compressedSize bytes,
+    // read from member(i).offset. Returns false if the data isn't valid.
+    bool extract(int i, const uint8_t* compressed, std::vector<uint8_t>& out) const;
+
+    // Decompress every member of the whole archive on nThreads threads, 0 for one per core.
+    bool extractAll(const uint8_t* archive, size_t size, std::vector<std::vector<uint8_t>>& out,
+        int nThreads = 0) const;
+
+private:
+    struct Segment {
+        uint32_t rawSize = 0;
+        uint32_t compressedSize = 0;
+        uint64_t offset = 0;        // From the start of the archive
+    };
+
+    bool extractSegment(const Segment& segment, const uint8_t* compressed, uint8_t* out) const;
+
+    uint32_t _format = kFormatBase;
+    std::vector<ArchiveMember> _members;
+    std::vector<Segment> _segments;
+};
+
+// Extract one file from an archive on disk, reading only the manifest and that
+// file's compressed data. Returns false if it can't be read or isn't in the archive.
+bool archiveExtractFile(const char* path, const std::string& name, std::vector<uint8_t>& out);
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Little endian integers for the headers of the entropy, columnar and archive
+// streams. Internal to the library; not installed with the public headers.
+namespace mccomp {
+
+inline void writeU24(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 3; i++) {
+        p[i] = uint8_t(v >> (8 * i));
+    }
+}
+
+inline void writeU32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = uint8_t(v >> (8 * i));
+    }
+}
+
+// Append to the end of out
+inline void appendU16(std::vector<uint8_t>& out, uint32_t v)
+{
+    out.push_back(uint8_t(v));
+    out.push_back(uint8_t(v >> 8));
+}
+
+inline void appendU32(std::vector<uint8_t>& out, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        out.push_back(uint8_t(v >> (8 * i)));
+    }
+}
+
+inline uint32_t readU16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+inline uint32_t readU24(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+inline uint32_t readU32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+}
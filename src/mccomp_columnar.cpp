@@ -0,0 +1,244 @@
+#include "mccomp_columnar.h"
+#include "mccomp_bytes.h"
+
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <thread>
+
+namespace mccomp {
+
+namespace {
+
+// Returns the end of the column that starts at p. end is the end of the line, before the '\n'.
+const uint8_t* splitColumn(const uint8_t* p, const uint8_t* end, const ColumnSplit& split)
+{
+    while (p < end && *p == split.delim) {
+        p++;
+    }
+    for (int i = 0; i < split.count && p < end; i++) {
+        while (p < end && *p != split.delim) {
+            p++;
+        }
+        while (p < end && *p == split.delim) {
+            p++;
+        }
+    }
+    return p;
+}
+
+std::vector<uint8_t> compressColumn(const std::vector<uint8_t>& raw, uint32_t format)
+{
+    // Worst case, every byte is escaped
+    std::vector<uint8_t> compressed(raw.size() * 2 + 16);
+    FormatState state;
+    Compressor compressor(format, &state);
+    Result r = compressor.compress(raw.data(), raw.size(), compressed.data(), compressed.size());
+    assert(size_t(r.nInput) == raw.size());
+    const size_t size = r.nOutput;
+    r = compressor.flush(compressed.data() + size, compressed.size() - size);
+    compressed.resize(size + r.nOutput);
+    return compressed;
+}
+
+struct ColumnEntry {
+    uint32_t rawSize = 0;
+    uint32_t compressedSize = 0;
+    size_t offset = 0;
+};
+
+// Parse and check the header. Returns the number of columns, or -1.
+int readHeader(const uint8_t* data, size_t size, uint32_t& format, ColumnEntry* entries)
+{
+    if (size < size_t(kColumnHeaderSize)) {
+        return -1;
+    }
+    format = data[0];
+    const int nColumns = data[1];
+    if (nColumns < 1 || nColumns > kMaxColumns || size < size_t(kColumnHeaderSize + nColumns * kColumnEntrySize)) {
+        return -1;
+    }
+    size_t offset = kColumnHeaderSize + nColumns * kColumnEntrySize;
+    for (int c = 0; c < nColumns; c++) {
+        const uint8_t* p = data + kColumnHeaderSize + c * kColumnEntrySize;
+        entries[c].rawSize = readU32(p);
+        entries[c].compressedSize = readU32(p + 4);
+        entries[c].offset = offset;
+        offset += entries[c].compressedSize;
+        // The raw size is allocated before decoding, so check it could be real.
+        if (entries[c].rawSize > uint64_t(entries[c].compressedSize) * kMaxExpansion) {
+            return -1;
+        }
+    }
+    if (offset > size) {
+        return -1;
+    }
+    return nColumns;
+}
+
+bool decompressColumn(const uint8_t* data, const ColumnEntry& entry, uint32_t format, std::vector<uint8_t>& out)
+{
+    out.resize(entry.rawSize);
+    FormatState state;
+    Decompressor decompressor(false, format, &state);
+    size_t in = 0;
+    size_t produced = 0;
+    while (in < entry.compressedSize || produced < entry.rawSize) {
+        Result r = decompressor.decompress(data + entry.offset + in, entry.compressedSize - in,
+            out.data() + produced, out.size() - produced);
+        if (r.error || (r.nInput == 0 && r.nOutput == 0)) {
+            return false;
+        }
+        in += r.nInput;
+        produced += r.nOutput;
+    }
+    return true;
+}
+
+} // namespace
+
+std::vector<uint8_t> columnCompress(const uint8_t* data, size_t size, const ColumnLayout& layout, uint32_t format)
+{
+    assert(layout.nSplits >= 0 && layout.nSplits < kMaxColumns);
+    assert(format <= UINT8_MAX);
+    const int nColumns = layout.nSplits + 1;
+
+    std::vector<uint8_t> raw[kMaxColumns];
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    while (p < end) {
+        const uint8_t* eol = static_cast<const uint8_t*>(memchr(p, '\n', end - p));
+        const uint8_t* lineEnd = eol ? eol : end;
+        for (int c = 0; c < layout.nSplits; c++) {
+            const uint8_t* q = splitColumn(p, lineEnd, layout.splits[c]);
+            raw[c].insert(raw[c].end(), p, q);
+            raw[c].push_back('\n');
+            p = q;
+        }
+        const uint8_t* next = eol ? eol + 1 : end;
+        raw[nColumns - 1].insert(raw[nColumns - 1].end(), p, next);
+        p = next;
+    }
+
+    std::vector<uint8_t> compressed[kMaxColumns];
+    {
+        std::vector<std::thread> threads;
+        for (int c = 0; c < nColumns; c++) {
+            threads.emplace_back([&, c] { compressed[c] = compressColumn(raw[c], format); });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+
+    std::vector<uint8_t> out(kColumnHeaderSize + nColumns * kColumnEntrySize);
+    out[0] = uint8_t(format);
+    out[1] = uint8_t(nColumns);
+    for (int c = 0; c < nColumns; c++) {
+        uint8_t* entry = out.data() + kColumnHeaderSize + c * kColumnEntrySize;
+        writeU32(entry, uint32_t(raw[c].size()));
+        writeU32(entry + 4, uint32_t(compressed[c].size()));
+    }
+    for (int c = 0; c < nColumns; c++) {
+        out.insert(out.end(), compressed[c].begin(), compressed[c].end());
+    }
+    return out;
+}
+
+int columnCount(const uint8_t* data, size_t size)
+{
+    uint32_t format = 0;
+    ColumnEntry entries[kMaxColumns];
+    return readHeader(data, size, format, entries);
+}
+
+bool columnDecompress(const uint8_t* data, size_t size, int column, std::vector<uint8_t>& out)
+{
+    uint32_t format = 0;
+    ColumnEntry entries[kMaxColumns];
+    const int nColumns = readHeader(data, size, format, entries);
+    if (column < 0 || column >= nColumns) {
+        return false;
+    }
+    return decompressColumn(data, entries[column], format, out);
+}
+
+bool columnDecompressAll(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+    uint32_t format = 0;
+    ColumnEntry entries[kMaxColumns];
+    const int nColumns = readHeader(data, size, format, entries);
+    if (nColumns < 0) {
+        return false;
+    }
+
+    std::vector<uint8_t> columns[kMaxColumns];
+    bool ok[kMaxColumns] = {};
+    {
+        std::vector<std::thread> threads;
+        for (int c = 0; c < nColumns; c++) {
+            // An exception can't leave the thread, so running out of memory is an error here.
+            threads.emplace_back([&, c] {
+                try {
+                    ok[c] = decompressColumn(data, entries[c], format, columns[c]);
+                }
+                catch (const std::bad_alloc&) {
+                    ok[c] = false;
+                }
+            });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+    for (int c = 0; c < nColumns; c++) {
+        if (!ok[c]) {
+            return false;
+        }
+    }
+
+    // Put the lines back together: a value from each column, in order.
+    const int last = nColumns - 1;
+    size_t total = 0;
+    for (int c = 0; c < nColumns; c++) {
+        total += columns[c].size();
+    }
+    out.clear();
+    out.reserve(total);
+    if (nColumns == 1) {
+        out = columns[0];
+        return true;
+    }
+
+    size_t pos[kMaxColumns] = {};
+    while (pos[0] < columns[0].size()) {
+        for (int c = 0; c < last; c++) {
+            // An empty column has no data(), and memchr() can't take nullptr.
+            const size_t remaining = columns[c].size() - pos[c];
+            if (remaining == 0) {
+                return false;
+            }
+            const uint8_t* p = columns[c].data() + pos[c];
+            const uint8_t* eol = static_cast<const uint8_t*>(memchr(p, '\n', remaining));
+            if (!eol) {
+                return false;
+            }
+            out.insert(out.end(), p, eol);
+            pos[c] = eol - columns[c].data() + 1;
+        }
+        const uint8_t* p = columns[last].data() + pos[last];
+        const size_t remaining = columns[last].size() - pos[last];
+        const uint8_t* eol = remaining ? static_cast<const uint8_t*>(memchr(p, '\n', remaining)) : nullptr;
+        const size_t n = eol ? size_t(eol - p) + 1 : remaining;
+        out.insert(out.end(), p, p + n);
+        pos[last] += n;
+    }
+    for (int c = 0; c < nColumns; c++) {
+        if (pos[c] != columns[c].size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace mccomp
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "mccomp.h"
+
+#include <vector>
+
+// Columnar mode for structured logs. Each line is split into columns, and each column
+// is compressed by its own Compressor, so timestamps, tags and messages each get a
+// Table of their own instead of evicting each other's pairs. The columns are stored
+// one after another with their sizes up front, so one column can be decompressed on
+// its own (for example only the tags, to filter) and all of them in parallel.
+//
+// Works on whole buffers and allocates, so it's for servers rather than devices.
+namespace mccomp {
+
+static constexpr int kMaxColumns = 8;
+
+// A column that ends after `count` tokens. Tokens are separated by runs of `delim`;
+// a leading run is part of the column, and so is the trailing run.
+struct ColumnSplit {
+    uint8_t delim = ' ';
+    int count = 1;
+};
+
+// How lines are split: a column for each split, and a last column with the rest
+// of the line, including the '\n'.
+struct ColumnLayout {
+    int nSplits = 0;
+    ColumnSplit splits[kMaxColumns - 1];
+};
+
+// logcat: "03-17 16:13:38.811  1702  2395 " "D " "WindowManager:" " message..."
+static constexpr ColumnLayout kLogcatColumns = { 3, { { ' ', 4 }, { ' ', 1 }, { ':', 1 } } };
+
+// Windows CBS: "2016-09-28 04:30:30," " Info    " "CBS    " "message..."
+static constexpr ColumnLayout kCbsColumns = { 3, { { ',', 1 }, { ' ', 1 }, { ' ', 1 } } };
+
+// Stream layout, integers are 4 bytes little endian:
+//   format      1 byte, kFormat* flags used by every column's Compressor
+//   nColumns    1 byte
+//   per column: raw size, compressed size
+// then the compressed columns in order. Decompressed, every column but the last
+// has one value per line terminated by '\n'.
+static constexpr int kColumnHeaderSize = 2;
+static constexpr int kColumnEntrySize = 8;
+
+// Compress data column by column.
+std::vector<uint8_t> columnCompress(const uint8_t* data, size_t size, const ColumnLayout& layout,
+    uint32_t format = kFormatBase);
+
+// Number of columns in a columnar stream, or -1 if the header isn't valid.
+int columnCount(const uint8_t* data, size_t size);
+
+// Decompress one column: a value per line, each terminated by '\n'.
+// Only that column's bytes are read. Returns false if the stream isn't valid.
+bool columnDecompress(const uint8_t* data, size_t size, int column, std::vector<uint8_t>& out);
+
+// Decompress all the columns in parallel, and put the lines back together.
+// Returns false if the stream isn't valid.
+bool columnDecompressAll(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+}
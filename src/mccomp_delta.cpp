@@ -0,0 +1,277 @@
+#include "mccomp_delta.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+namespace mccomp {
+
+namespace {
+
+// Both sides parse the original text: the encoder its input, the decoder its output.
+// At each '\n' the line in progress becomes the previous line.
+void track(LineFields& cur, LineFields& prev, const uint8_t* data, size_t size)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    while (p < end) {
+        while (p < end && cur.parse(*p)) {
+            p++;
+        }
+        const uint8_t* eol = static_cast<const uint8_t*>(memchr(p, '\n', end - p));
+        if (!eol) {
+            break;
+        }
+        prev = cur;
+        cur.reset();
+        p = eol + 1;
+    }
+}
+
+} // namespace
+
+bool LineFields::parse(uint8_t byte)
+{
+    if (_done) {
+        return false;
+    }
+    if (byte >= '0' && byte <= '9') {
+        if (!_inDigits) {
+            if (_count == kDeltaMaxFields) {
+                _done = true;
+                return false;
+            }
+            _inDigits = true;
+        }
+        if (_next.width == kDeltaMaxDigits) {
+            // Not a field; the digits so far are left as is.
+            _done = true;
+            return false;
+        }
+        _next.value = _next.value * 10 + (byte - '0');
+        _next.width++;
+        return true;
+    }
+    if (_inDigits) {
+        _field[_count++] = _next;
+        _next = Field();
+        _inDigits = false;
+    }
+    if (isDeltaSeparator(byte) && _next.sepLen < kDeltaMaxSep) {
+        _next.sep[_next.sepLen++] = byte;
+        return true;
+    }
+    _done = true;
+    return false;
+}
+
+Result DeltaEncoder::encode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize)
+{
+    const uint8_t* in = input;
+    const uint8_t* inEnd = input + inputSize;
+    uint8_t* out = output;
+    const uint8_t* outEnd = output + outputSize;
+
+    while (in < inEnd && out < outEnd) {
+        if (_lineStart) {
+            // Parse ahead to find the fields that have the same shape as the previous line
+            LineFields fields;
+            const uint8_t* p = in;
+            while (p < inEnd && fields.parse(*p)) {
+                p++;
+            }
+            int nFields = 0;
+            int size = 0;
+            if (fields.done()) {
+                while (nFields < fields.count() && nFields < _prev.count()
+                    && fields.field(nFields).sameShape(_prev.field(nFields))) {
+                    size += fields.field(nFields).size();
+                    nFields++;
+                }
+            }
+
+            // Fields that wouldn't fit even an empty output buffer are left as is.
+            if (nFields > 0 && 2 + nFields * 8 > int(outputSize)) {
+                nFields = 0;
+            }
+            if (nFields > 0) {
+                uint8_t header[2 + kDeltaMaxFields * 8];
+                int n = 0;
+                header[n++] = kDeltaMarker;
+                header[n++] = uint8_t('A' + nFields);
+                for (int i = 0; i < nFields; i++) {
+                    const int64_t delta = int64_t(fields.field(i).value) - int64_t(_prev.field(i).value);
+                    uint32_t zigzag = delta < 0 ? uint32_t(-delta) * 2 - 1 : uint32_t(delta) * 2;
+                    do {
+                        const uint8_t group = zigzag & 15;
+                        zigzag >>= 4;
+                        header[n++] = uint8_t((zigzag ? 'a' : 'A') + group);
+                    } while (zigzag);
+                }
+                if (out + n > outEnd) {
+                    break;
+                }
+                memcpy(out, header, n);
+                out += n;
+                track(_cur, _prev, in, size);
+                in += size;
+                _lineStart = false;
+                continue;
+            }
+
+            if (*in == kDeltaMarker || *in == kDeltaEscape) {
+                if (out + 2 > outEnd) {
+                    break;
+                }
+                *out++ = kDeltaEscape;
+                *out++ = *in;
+                track(_cur, _prev, in, 1);
+                in++;
+                _lineStart = false;
+                continue;
+            }
+            _lineStart = false;
+        }
+
+        // The rest of the line is copied as is
+        size_t n = std::min(size_t(inEnd - in), size_t(outEnd - out));
+        const uint8_t* eol = static_cast<const uint8_t*>(memchr(in, '\n', n));
+        if (eol) {
+            n = eol - in + 1;
+            _lineStart = true;
+        }
+        memcpy(out, in, n);
+        track(_cur, _prev, in, n);
+        in += n;
+        out += n;
+    }
+    return Result{
+        static_cast<int>(in - input),
+        static_cast<int>(out - output),
+        false
+    };
+}
+
+void DeltaDecoder::restoreFields()
+{
+    int n = 0;
+    for (int i = 0; i < _nFields; i++) {
+        const LineFields::Field& field = _prev.field(i);
+        memcpy(_pending + n, field.sep, field.sepLen);
+        n += field.sepLen;
+
+        uint32_t value = uint32_t(int64_t(field.value) + _delta[i]);
+        for (int j = field.width - 1; j >= 0; j--) {
+            _pending[n + j] = uint8_t('0' + value % 10);
+            value /= 10;
+        }
+        n += field.width;
+    }
+    _pendingPos = 0;
+    _pendingSize = n;
+}
+
+Result DeltaDecoder::decode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize)
+{
+    const uint8_t* in = input;
+    const uint8_t* inEnd = input + inputSize;
+    uint8_t* out = output;
+    const uint8_t* outEnd = output + outputSize;
+
+    while (!_error) {
+        if (_pendingPos < _pendingSize) {
+            const int n = std::min(_pendingSize - _pendingPos, int(outEnd - out));
+            memcpy(out, _pending + _pendingPos, n);
+            track(_cur, _prev, out, n);
+            _pendingPos += n;
+            out += n;
+            if (_pendingPos < _pendingSize) {
+                break;
+            }
+        }
+        if (in == inEnd || out == outEnd) {
+            break;
+        }
+
+        const uint8_t byte = *in;
+        switch (_state) {
+        case State::kLineStart:
+            if (byte == kDeltaMarker) {
+                _state = State::kCount;
+                in++;
+            }
+            else if (byte == kDeltaEscape) {
+                _state = State::kEscaped;
+                in++;
+            }
+            else {
+                _state = State::kLine;
+            }
+            break;
+
+        case State::kEscaped:
+            *out = byte;
+            track(_cur, _prev, out, 1);
+            out++;
+            in++;
+            _state = State::kLine;
+            break;
+
+        case State::kCount:
+            _nFields = byte - 'A';
+            if (_nFields < 1 || _nFields > _prev.count()) {
+                _error = true;
+                break;
+            }
+            _nDeltas = 0;
+            _zigzag = 0;
+            _shift = 0;
+            _state = State::kDeltas;
+            in++;
+            break;
+
+        case State::kDeltas:
+            if (byte >= 'a' && byte < 'a' + 16 && _shift < 28) {
+                _zigzag |= uint32_t(byte - 'a') << _shift;
+                _shift += 4;
+            }
+            else if (byte >= 'A' && byte < 'A' + 16) {
+                _zigzag |= uint32_t(byte - 'A') << _shift;
+                _delta[_nDeltas++] = int32_t(_zigzag >> 1) ^ -int32_t(_zigzag & 1);
+                _zigzag = 0;
+                _shift = 0;
+                if (_nDeltas == _nFields) {
+                    restoreFields();
+                    _state = State::kLine;
+                }
+            }
+            else {
+                _error = true;
+                break;
+            }
+            in++;
+            break;
+
+        case State::kLine: {
+            size_t n = std::min(size_t(inEnd - in), size_t(outEnd - out));
+            const uint8_t* eol = static_cast<const uint8_t*>(memchr(in, '\n', n));
+            if (eol) {
+                n = eol - in + 1;
+                _state = State::kLineStart;
+            }
+            memcpy(out, in, n);
+            track(_cur, _prev, out, n);
+            in += n;
+            out += n;
+            break;
+        }
+        }
+    }
+    return Result{
+        static_cast<int>(in - input),
+        static_cast<int>(out - output),
+        false
+    };
+}
+
+} // namespace mccomp
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "mccomp.h"
+
+// Optional pre-transform for logs where each line starts with a timestamp and other
+// numbers, such as "03-17 16:13:38.811  1702  2395 D ..." or "2016-09-28 04:30:30, ...".
+// The leading numeric fields of a line are replaced by deltas from the same fields of
+// the previous line. Those digits change a little every line, which the pair table
+// handles poorly; the deltas are mostly the same few bytes.
+//
+// DeltaEncoder output is the input to Compressor, and Decompressor output is the input
+// to DeltaDecoder. No memory allocation, and ASCII stays ASCII so 0xff still works as EOF.
+namespace mccomp {
+
+static constexpr int kDeltaMaxFields = 8;   // Leading numeric fields per line
+static constexpr int kDeltaMaxDigits = 9;   // Longer numbers end the fields
+static constexpr int kDeltaMaxSep = 3;      // Longest separator before a field
+
+// A line that starts with kDeltaMarker is followed by the number of fields as
+// 'A' + n, then a delta per field. A delta is zigzag encoded in 4 bit groups, low
+// group first: 'a' + group if more follow, 'A' + group for the last one.
+// Lines that start with kDeltaMarker or kDeltaEscape are escaped with kDeltaEscape.
+static constexpr uint8_t kDeltaMarker = 0x0b;   // \v
+static constexpr uint8_t kDeltaEscape = 0x0c;   // \f
+
+// Bytes that can separate the leading numeric fields
+inline bool isDeltaSeparator(uint8_t byte) {
+    return byte == ' ' || byte == '-' || byte == ':' || byte == '.' || byte == ',' || byte == '/';
+}
+
+// The leading numeric fields of a line, parsed a byte at a time.
+class LineFields {
+public:
+    struct Field {
+        uint32_t value = 0;
+        uint8_t width = 0;      // Number of digits, including leading zeros
+        uint8_t sepLen = 0;     // Separator before the digits
+        uint8_t sep[kDeltaMaxSep] = {};
+
+        // Same separator and width, so only the value needs to be sent
+        bool sameShape(const Field& other) const {
+            return width == other.width && sepLen == other.sepLen && memcmp(sep, other.sep, sepLen) == 0;
+        }
+        // Bytes of the line used by this field
+        int size() const { return sepLen + width; }
+    };
+
+    // Start a new line
+    void reset() { *this = LineFields(); }
+
+    // Parse the next byte of the line. Returns false if the byte isn't part of
+    // the fields; the fields are then complete and done() is true.
+    bool parse(uint8_t byte);
+
+    bool done() const { return _done; }
+    int count() const { return _count; }
+    const Field& field(int i) const { return _field[i]; }
+
+private:
+    bool _done = false;
+    bool _inDigits = false;
+    int _count = 0;         // Complete fields
+    Field _next;            // Field in progress
+    Field _field[kDeltaMaxFields];
+};
+
+// Streaming delta transform, applied before Compressor.
+class DeltaEncoder {
+public:
+    // Transform a chunk of data. Can be called multiple times for streaming.
+    // A line's fields are only delta coded if they are complete in the input,
+    // so input buffers should be larger than the fields. outputSize must be at
+    // least 2; 66 or more fits the deltas for kDeltaMaxFields fields.
+    //
+    // Returns:
+    //   Result with nInput bytes consumed and nOutput bytes produced.
+    //   Call again with remaining data if r.nInput < inputSize.
+    Result encode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize);
+
+private:
+    bool _lineStart = true;
+    LineFields _cur;    // Line being written
+    LineFields _prev;   // Previous complete line
+};
+
+// Streaming inverse of DeltaEncoder, applied after Decompressor.
+class DeltaDecoder {
+public:
+    // Restore a chunk of data. Can be called multiple times for streaming.
+    //
+    // Returns:
+    //   Result with nInput bytes consumed and nOutput bytes produced.
+    //   Repeat calls until all data is restored.
+    Result decode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize);
+
+    // True if the input was not written by DeltaEncoder. No more data
+    // will be consumed or produced.
+    bool error() const { return _error; }
+
+private:
+    enum class State : uint8_t {
+        kLineStart,
+        kEscaped,
+        kCount,
+        kDeltas,
+        kLine
+    };
+
+    // Write the restored fields to _pending
+    void restoreFields();
+
+    State _state = State::kLineStart;
+    bool _error = false;
+    int _nFields = 0;
+    int _nDeltas = 0;
+    uint32_t _zigzag = 0;
+    int _shift = 0;
+    int32_t _delta[kDeltaMaxFields] = {};
+    int _pendingPos = 0;
+    int _pendingSize = 0;
+    uint8_t _pending[kDeltaMaxFields * (kDeltaMaxSep + kDeltaMaxDigits)];
+    LineFields _cur;
+    LineFields _prev;
+};
+
+}
@@ -0,0 +1,421 @@
+#include "mccomp_entropy.h"
+#include "mccomp_bytes.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+namespace mccomp {
+
+namespace {
+
+static constexpr int kNumSymbols = 256;
+
+// Split a block into kEntropyStreams segments: all the same size except the last.
+int segmentSize(int rawSize, int stream)
+{
+    const int seg = (rawSize + kEntropyStreams - 1) / kEntropyStreams;
+    return std::max(0, std::min(seg, rawSize - stream * seg));
+}
+
+// Huffman code lengths, limited to kEntropyMaxBits. If the tree is too deep,
+// the frequencies are flattened and the tree is rebuilt.
+void buildLengths(const uint32_t* freq, uint8_t* lengths)
+{
+    uint32_t f[kNumSymbols];
+    memcpy(f, freq, sizeof(f));
+    memset(lengths, 0, kNumSymbols);
+
+    while (true) {
+        // Leaves, sorted by frequency
+        int sym[kNumSymbols];
+        int n = 0;
+        for (int i = 0; i < kNumSymbols; i++) {
+            if (f[i] > 0) {
+                sym[n++] = i;
+            }
+        }
+        if (n == 0) {
+            return;
+        }
+        if (n == 1) {
+            lengths[sym[0]] = 1;
+            return;
+        }
+        std::sort(sym, sym + n, [&](int a, int b) { return f[a] < f[b] || (f[a] == f[b] && a < b); });
+
+        // Two queue construction: leaves are [0, n), internal nodes [n, 2n-1)
+        // are created in increasing weight order, so both queues stay sorted.
+        uint32_t weight[2 * kNumSymbols];
+        int parent[2 * kNumSymbols];
+        for (int i = 0; i < n; i++) {
+            weight[i] = f[sym[i]];
+        }
+        int leaf = 0;
+        int node = n;
+        for (int next = n; next < 2 * n - 1; next++) {
+            int pick[2];
+            for (int& p : pick) {
+                if (leaf < n && (node >= next || weight[leaf] <= weight[node])) {
+                    p = leaf++;
+                }
+                else {
+                    p = node++;
+                }
+            }
+            weight[next] = weight[pick[0]] + weight[pick[1]];
+            parent[pick[0]] = next;
+            parent[pick[1]] = next;
+        }
+
+        // Parents always come after children, so depths resolve top down.
+        int depth[2 * kNumSymbols];
+        const int root = 2 * n - 2;
+        depth[root] = 0;
+        int maxDepth = 0;
+        for (int i = root - 1; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+            maxDepth = std::max(maxDepth, depth[i]);
+        }
+
+        if (maxDepth <= kEntropyMaxBits) {
+            for (int i = 0; i < n; i++) {
+                lengths[sym[i]] = uint8_t(depth[i]);
+            }
+            return;
+        }
+        for (int i = 0; i < kNumSymbols; i++) {
+            if (f[i] > 0) {
+                f[i] = (f[i] >> 1) | 1;
+            }
+        }
+    }
+}
+
+// Canonical codes from lengths, bit reversed for LSB first streams.
+// Returns false if the lengths don't form a valid prefix code.
+bool buildCodes(const uint8_t* lengths, uint16_t* codes)
+{
+    int count[kEntropyMaxBits + 1] = {};
+    for (int i = 0; i < kNumSymbols; i++) {
+        if (lengths[i] > kEntropyMaxBits) {
+            return false;
+        }
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+
+    int kraft = 0;
+    int next[kEntropyMaxBits + 1] = {};
+    int code = 0;
+    for (int len = 1; len <= kEntropyMaxBits; len++) {
+        kraft += count[len] << (kEntropyMaxBits - len);
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+    if (kraft > (1 << kEntropyMaxBits)) {
+        return false;
+    }
+
+    for (int i = 0; i < kNumSymbols; i++) {
+        const int len = lengths[i];
+        codes[i] = 0;
+        if (len == 0) {
+            continue;
+        }
+        const int c = next[len]++;
+        int r = 0;
+        for (int b = 0; b < len; b++) {
+            r |= ((c >> b) & 1) << (len - 1 - b);
+        }
+        codes[i] = uint16_t(r);
+    }
+    return true;
+}
+
+class BitWriter {
+public:
+    explicit BitWriter(uint8_t* out) : _out(out), _start(out) {}
+
+    void put(uint32_t code, int len) {
+        _acc |= uint64_t(code) << _bits;
+        _bits += len;
+        while (_bits >= 8) {
+            *_out++ = uint8_t(_acc);
+            _acc >>= 8;
+            _bits -= 8;
+        }
+    }
+
+    // Flush the last partial byte, returns the bytes written
+    int flush() {
+        if (_bits > 0) {
+            *_out++ = uint8_t(_acc);
+        }
+        _acc = 0;
+        _bits = 0;
+        return int(_out - _start);
+    }
+
+private:
+    uint8_t* _out;
+    uint8_t* _start;
+    uint64_t _acc = 0;
+    int _bits = 0;
+};
+
+class BitReader {
+public:
+    BitReader() = default;
+    BitReader(const uint8_t* p, const uint8_t* end) : _p(p), _end(end) {}
+
+    // After refill there are at least 56 bits, enough for 5 codes.
+    // Reading past the end gives zeros; the symbol count bounds decoding.
+    void refill() {
+        while (_bits <= 56) {
+            _acc |= uint64_t(_p < _end ? *_p++ : 0) << _bits;
+            _bits += 8;
+        }
+    }
+
+    uint8_t decode(const uint16_t* table) {
+        const uint16_t entry = table[_acc & ((1 << kEntropyMaxBits) - 1)];
+        const int len = entry & 15;
+        _acc >>= len;
+        _bits -= len;
+        return uint8_t(entry >> 4);
+    }
+
+private:
+    const uint8_t* _p = nullptr;
+    const uint8_t* _end = nullptr;
+    uint64_t _acc = 0;
+    int _bits = 0;
+};
+
+} // namespace
+
+void EntropyEncoder::encodeBlock()
+{
+    assert(_encPos == _encSize);
+    uint8_t* enc = _enc.data();
+    const uint8_t* raw = _raw.data();
+
+    uint32_t freq[kNumSymbols] = {};
+    for (int i = 0; i < _rawSize; i++) {
+        freq[raw[i]]++;
+    }
+    uint8_t lengths[kNumSymbols];
+    uint16_t codes[kNumSymbols];
+    buildLengths(freq, lengths);
+    bool ok = buildCodes(lengths, codes);
+    assert(ok);
+    (void)ok;
+
+    uint64_t bits = 0;
+    for (int i = 0; i < kNumSymbols; i++) {
+        bits += uint64_t(freq[i]) * lengths[i];
+    }
+    const uint64_t huffmanSize = kEntropyHuffmanHeaderSize + bits / 8 + kEntropyStreams;
+
+    writeU24(enc + 1, _rawSize);
+    if (huffmanSize >= uint64_t(kEntropyHeaderSize + _rawSize)) {
+        enc[0] = kEntropyStored;
+        memcpy(enc + kEntropyHeaderSize, raw, _rawSize);
+        _encSize = kEntropyHeaderSize + _rawSize;
+    }
+    else {
+        enc[0] = kEntropyHuffman;
+        for (int i = 0; i < kNumSymbols; i += 2) {
+            enc[kEntropyHeaderSize + i / 2] = uint8_t(lengths[i] | (lengths[i + 1] << 4));
+        }
+        uint8_t* sizes = enc + kEntropyHeaderSize + kNumSymbols / 2;
+        uint8_t* out = enc + kEntropyHuffmanHeaderSize;
+        for (int s = 0; s < kEntropyStreams; s++) {
+            const int segStart = s * segmentSize(_rawSize, 0);
+            const int segSize = segmentSize(_rawSize, s);
+            BitWriter writer(out);
+            for (int i = segStart; i < segStart + segSize; i++) {
+                writer.put(codes[raw[i]], lengths[raw[i]]);
+            }
+            const int n = writer.flush();
+            writeU24(sizes + 3 * s, n);
+            out += n;
+        }
+        _encSize = int(out - enc);
+    }
+    _encPos = 0;
+    _rawSize = 0;
+}
+
+size_t EntropyEncoder::drain(uint8_t* output, size_t outputSize)
+{
+    const size_t n = std::min(outputSize, size_t(_encSize - _encPos));
+    memcpy(output, _enc.data() + _encPos, n);
+    _encPos += int(n);
+    return n;
+}
+
+Result EntropyEncoder::encode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize)
+{
+    size_t in = 0;
+    size_t out = 0;
+    while (true) {
+        out += drain(output + out, outputSize - out);
+        if (_encPos < _encSize || in == inputSize) {
+            break;
+        }
+        const size_t n = std::min(inputSize - in, size_t(kEntropyBlockSize - _rawSize));
+        memcpy(_raw.data() + _rawSize, input + in, n);
+        _rawSize += int(n);
+        in += n;
+        if (_rawSize == kEntropyBlockSize) {
+            encodeBlock();
+        }
+    }
+    return Result{ int(in), int(out), false };
+}
+
+Result EntropyEncoder::finish(uint8_t* output, size_t outputSize)
+{
+    size_t out = drain(output, outputSize);
+    if (_encPos == _encSize && _rawSize > 0) {
+        encodeBlock();
+        out += drain(output + out, outputSize - out);
+    }
+    return Result{ 0, int(out), false };
+}
+
+int EntropyDecoder::blockSize() const
+{
+    if (_encSize < kEntropyHeaderSize) {
+        return 0;
+    }
+    const int rawSize = int(readU24(_enc.data() + 1));
+    if (_enc[0] == kEntropyStored) {
+        return kEntropyHeaderSize + rawSize;
+    }
+    if (_encSize < kEntropyHuffmanHeaderSize) {
+        return 0;
+    }
+    int size = kEntropyHuffmanHeaderSize;
+    const uint8_t* sizes = _enc.data() + kEntropyHeaderSize + kNumSymbols / 2;
+    for (int s = 0; s < kEntropyStreams; s++) {
+        size += int(readU24(sizes + 3 * s));
+    }
+    return size;
+}
+
+bool EntropyDecoder::decodeBlock()
+{
+    const uint8_t* enc = _enc.data();
+    uint8_t* raw = _raw.data();
+    _rawSize = int(readU24(enc + 1));
+    _rawPos = 0;
+
+    if (enc[0] == kEntropyStored) {
+        memcpy(raw, enc + kEntropyHeaderSize, _rawSize);
+        return true;
+    }
+
+    uint8_t lengths[kNumSymbols];
+    for (int i = 0; i < kNumSymbols; i += 2) {
+        const uint8_t packed = enc[kEntropyHeaderSize + i / 2];
+        lengths[i] = packed & 15;
+        lengths[i + 1] = packed >> 4;
+    }
+    uint16_t codes[kNumSymbols];
+    if (!buildCodes(lengths, codes)) {
+        return false;
+    }
+
+    // Every code fills all the table slots that start with it.
+    _table.fill(0);
+    for (int i = 0; i < kNumSymbols; i++) {
+        const int len = lengths[i];
+        if (len == 0) {
+            continue;
+        }
+        for (int idx = codes[i]; idx < (1 << kEntropyMaxBits); idx += 1 << len) {
+            _table[idx] = uint16_t(i << 4 | len);
+        }
+    }
+
+    BitReader readers[kEntropyStreams];
+    uint8_t* dst[kEntropyStreams];
+    const uint8_t* sizes = enc + kEntropyHeaderSize + kNumSymbols / 2;
+    const uint8_t* p = enc + kEntropyHuffmanHeaderSize;
+    for (int s = 0; s < kEntropyStreams; s++) {
+        const int n = int(readU24(sizes + 3 * s));
+        readers[s] = BitReader(p, p + n);
+        p += n;
+        dst[s] = raw + s * segmentSize(_rawSize, 0);
+    }
+
+    // Interleave the streams while all have symbols left: the last segment is
+    // the shortest. Each refill is good for 5 codes.
+    const uint16_t* table = _table.data();
+    const int common = segmentSize(_rawSize, kEntropyStreams - 1);
+    int i = 0;
+    for (; i + 4 <= common; i += 4) {
+        for (int s = 0; s < kEntropyStreams; s++) {
+            readers[s].refill();
+            dst[s][i + 0] = readers[s].decode(table);
+            dst[s][i + 1] = readers[s].decode(table);
+            dst[s][i + 2] = readers[s].decode(table);
+            dst[s][i + 3] = readers[s].decode(table);
+        }
+    }
+    for (int s = 0; s < kEntropyStreams; s++) {
+        const int n = segmentSize(_rawSize, s);
+        for (int j = i; j < n; j++) {
+            readers[s].refill();
+            dst[s][j] = readers[s].decode(table);
+        }
+    }
+    return true;
+}
+
+Result EntropyDecoder::decode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize)
+{
+    size_t in = 0;
+    size_t out = 0;
+    while (!_error) {
+        // Drain the decoded block
+        const size_t n = std::min(outputSize - out, size_t(_rawSize - _rawPos));
+        memcpy(output + out, _raw.data() + _rawPos, n);
+        _rawPos += int(n);
+        out += n;
+        if (_rawPos < _rawSize || in == inputSize) {
+            break;
+        }
+
+        // Accumulate the next block. The header says how much more is needed.
+        int need = blockSize();
+        if (need == 0) {
+            need = _encSize < kEntropyHeaderSize ? kEntropyHeaderSize : kEntropyHuffmanHeaderSize;
+        }
+        if (_encSize >= kEntropyHeaderSize) {
+            const int rawSize = int(readU24(_enc.data() + 1));
+            if ((_enc[0] != kEntropyStored && _enc[0] != kEntropyHuffman)
+                || rawSize == 0 || rawSize > kEntropyBlockSize || need > kEntropyMaxBlock) {
+                _error = true;
+                break;
+            }
+        }
+        const size_t copy = std::min(inputSize - in, size_t(need - _encSize));
+        memcpy(_enc.data() + _encSize, input + in, copy);
+        _encSize += int(copy);
+        in += copy;
+
+        if (_encSize == blockSize()) {
+            if (!decodeBlock()) {
+                _error = true;
+            }
+            _encSize = 0;
+        }
+    }
+    return Result{ int(in), int(out), false };
+}
+
+} // namespace mccomp
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "mccomp.h"
+
+// Optional second stage for archiving: entropy codes a mccomp stream (or any data)
+// with canonical Huffman codes, built per block. The mccomp stream is byte aligned
+// and skewed towards common token values, which this recovers on the server.
+// Decoding gives back the exact mccomp stream, so devices keep writing plain mccomp.
+//
+// Not intended for microcontrollers: each encoder and decoder holds two block buffers.
+namespace mccomp {
+
+static constexpr int kEntropyBlockSize = 32 * 1024;   // Uncompressed bytes per block
+static constexpr int kEntropyMaxBits = 11;            // Longest code, sizes the decode table
+static constexpr int kEntropyStreams = 4;             // Interleaved bit streams per block
+
+// Block header:
+//   type      1 byte, kEntropyStored or kEntropyHuffman
+//   rawSize   3 bytes, little endian
+// Huffman blocks then have:
+//   lengths   128 bytes, 4 bit code length per symbol, low nibble first
+//   sizes     3 bytes per stream, little endian
+// followed by the data: raw bytes, or the streams one after the other.
+static constexpr uint8_t kEntropyStored = 0;
+static constexpr uint8_t kEntropyHuffman = 1;
+static constexpr int kEntropyHeaderSize = 4;
+static constexpr int kEntropyHuffmanHeaderSize = kEntropyHeaderSize + 128 + 3 * kEntropyStreams;
+
+// Largest encoded block. Huffman blocks that would be larger than stored are stored.
+static constexpr int kEntropyMaxBlock = kEntropyHuffmanHeaderSize + kEntropyBlockSize;
+
+// Streaming entropy encoder.
+class EntropyEncoder {
+public:
+    // Encode a chunk of data. Can be called multiple times for streaming.
+    //
+    // Returns:
+    //   Result with nInput bytes consumed and nOutput bytes produced.
+    //   Call again with remaining data if r.nInput < inputSize.
+    Result encode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize);
+
+    // Encode the final partial block at the end of the stream.
+    // Call repeatedly until it returns nOutput == 0.
+    Result finish(uint8_t* output, size_t outputSize);
+
+private:
+    void encodeBlock();
+    size_t drain(uint8_t* output, size_t outputSize);
+
+    int _rawSize = 0;
+    int _encSize = 0;
+    int _encPos = 0;
+    std::array<uint8_t, kEntropyBlockSize> _raw;
+    std::array<uint8_t, kEntropyMaxBlock + 8 * kEntropyStreams> _enc;
+};
+
+// Streaming entropy decoder for data written by EntropyEncoder.
+class EntropyDecoder {
+public:
+    // Decode a chunk of data. Can be called multiple times for streaming.
+    //
+    // Returns:
+    //   Result with nInput bytes consumed and nOutput bytes produced.
+    //   Repeat calls until all data is decoded.
+    Result decode(const uint8_t* input, size_t inputSize, uint8_t* output, size_t outputSize);
+
+    // True if the input was not a valid entropy coded stream. No more
+    // data will be consumed or produced.
+    bool error() const { return _error; }
+
+private:
+    // Bytes of the current block needed before it can be decoded, 0 if not known yet
+    int blockSize() const;
+    bool decodeBlock();
+
+    bool _error = false;
+    int _encSize = 0;
+    int _rawSize = 0;
+    int _rawPos = 0;
+    std::array<uint8_t, kEntropyMaxBlock> _enc;
+    std::array<uint8_t, kEntropyBlockSize> _raw;
+    std::array<uint16_t, 1 << kEntropyMaxBits> _table;  // symbol << 4 | length
+};
+
+}
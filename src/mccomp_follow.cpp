@@ -0,0 +1,130 @@
+#include "mccomp_follow.h"
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace mccomp {
+
+Follower::Follower(uint32_t format, bool eofFF)
+    : _format(format),
+    _eofFF(eofFF),
+    _decompressor(eofFF, format, &_state)
+{
+}
+
+Follower::~Follower()
+{
+    close();
+}
+
+bool Follower::open(const char* path)
+{
+    close();
+    _file = fopen(path, "rb");
+    if (!_file) {
+        return false;
+    }
+#ifdef __linux__
+    _inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_inotify >= 0 && inotify_add_watch(_inotify, path, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB) < 0) {
+        ::close(_inotify);
+        _inotify = -1;
+    }
+#endif
+    restart();
+    return true;
+}
+
+void Follower::close()
+{
+    if (_file) {
+        fclose(_file);
+        _file = nullptr;
+    }
+#ifdef __linux__
+    if (_inotify >= 0) {
+        ::close(_inotify);
+        _inotify = -1;
+    }
+#endif
+}
+
+void Follower::restart()
+{
+    _offset = 0;
+    _bufferPos = 0;
+    _bufferSize = 0;
+    _decompressor = Decompressor(_eofFF, _format, &_state);
+}
+
+size_t Follower::read(uint8_t* output, size_t outputSize)
+{
+    if (!_file) {
+        return 0;
+    }
+
+    // A file shorter than what was read has been truncated and rewritten.
+    if (fseek(_file, 0, SEEK_END) == 0 && ftell(_file) < _offset + _bufferPos) {
+        restart();
+    }
+
+    size_t nOutput = 0;
+    while (nOutput < outputSize) {
+        if (_bufferPos == _bufferSize) {
+            // Only read past what has been decoded: the file is read once.
+            _offset += _bufferPos;
+            _bufferPos = 0;
+            _bufferSize = 0;
+            if (fseek(_file, _offset, SEEK_SET) == 0) {
+                _bufferSize = int(fread(_buffer.data(), 1, _buffer.size(), _file));
+            }
+            if (_eofFF) {
+                // Flash that isn't written yet. Stop before it, so a token cut off
+                // by it is carried, and read again from there next time.
+                const void* ff = memchr(_buffer.data(), 0xff, _bufferSize);
+                if (ff) {
+                    _bufferSize = int(static_cast<const uint8_t*>(ff) - _buffer.data());
+                }
+            }
+        }
+
+        // With no new input this returns nothing, which ends the loop.
+        Result r = _decompressor.decompress(_buffer.data() + _bufferPos, _bufferSize - _bufferPos,
+            output + nOutput, outputSize - nOutput);
+        _bufferPos += r.nInput;
+        nOutput += r.nOutput;
+
+        if (r.error || (r.nInput == 0 && r.nOutput == 0)) {
+            break;
+        }
+    }
+    return nOutput;
+}
+
+bool Follower::wait(int timeoutMs)
+{
+#ifdef __linux__
+    if (_inotify >= 0) {
+        pollfd pfd = { _inotify, POLLIN, 0 };
+        if (poll(&pfd, 1, timeoutMs) <= 0) {
+            return false;
+        }
+        // Drain the events; any of them means "read again".
+        alignas(inotify_event) char events[1024];
+        while (::read(_inotify, events, sizeof(events)) > 0) {
+        }
+        return true;
+    }
+#endif
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+    return true;
+}
+
+} // namespace mccomp
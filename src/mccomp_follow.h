@@ -0,0 +1,59 @@
+#pragma once
+
+#include "mccomp.h"
+
+#include <cstdio>
+#include <array>
+
+// Follow a compressed log that is still being written, like `tail -f`.
+// A Follower keeps its Decompressor between reads, so only new bytes are decoded,
+// and a token split by the writer is finished when the rest arrives.
+namespace mccomp {
+
+class Follower {
+public:
+    // Construct a follower.
+    //
+    // Parameters:
+    //   format - the kFormat* flags the file is compressed with.
+    //   eofFF  - If true, 0xff is treated as flash that is not written yet rather
+    //            than the end of the stream: the follower waits for it to be written.
+    //            Only for text, as with Decompressor.
+    Follower(uint32_t format = kFormatBase, bool eofFF = true);
+    ~Follower();
+
+    Follower(const Follower&) = delete;
+    Follower& operator=(const Follower&) = delete;
+
+    // Start following a file from its beginning. Returns false if it can't be opened.
+    bool open(const char* path);
+    void close();
+
+    // Decompress data written since the last call, up to outputSize bytes.
+    // Returns the number of bytes written to output; 0 if there is nothing new.
+    // If the file gets shorter (truncated and rewritten), it is followed from the start.
+    // Corrupt data is treated like data that isn't written yet: reading stops before it.
+    size_t read(uint8_t* output, size_t outputSize);
+
+    // Wait until the file changes, or timeoutMs passes. Uses inotify on Linux;
+    // elsewhere it sleeps for timeoutMs. Returns false on timeout.
+    bool wait(int timeoutMs);
+
+private:
+    static constexpr int kBufferSize = 4096;
+
+    void restart();
+
+    uint32_t _format = kFormatBase;
+    bool _eofFF = true;
+    FILE* _file = nullptr;
+    int _inotify = -1;
+    long _offset = 0;       // File position of _buffer[0]
+    int _bufferPos = 0;
+    int _bufferSize = 0;
+    FormatState _state;     // Before _decompressor, which resets it
+    Decompressor _decompressor;
+    std::array<uint8_t, kBufferSize> _buffer;
+};
+
+}